@@ -23,34 +23,87 @@
 
 #include <unistd.h>
 #include <stdio.h>
+#include <syslog.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "apache_ips_main.h"
 #include "apache_ips_regex.h"
+#include "proxy_overload.h"
+#include "proxy_stats.h"
 #include "reverse_proxy.h"
 
 /*********
  * DEFINES
  *********/
 
-#define BUFFERSIZE 1000000
+// set to 1 to forward requests for low_risk_routes before inspecting them
+#ifndef ASYNC_INSPECTION
+#define ASYNC_INSPECTION 0
+#endif
+
+// most ranges allowed in a Range header
+#define MAX_RANGES 50
+
+// verdict on a request whose inspection ran out of regex evaluation budget
+#ifndef REGEX_BUDGET_VERDICT
+#define REGEX_BUDGET_VERDICT PROXY_BLOCK
+#endif
 
 /*********************
  * STATIC DECLARATIONS
  *********************/
 
+/*
+    Path prefixes of GET and HEAD requests that are inspected out of band when
+    ASYNC_INSPECTION is enabled. The list is terminated by NULL.
+*/
+static const char *low_risk_routes[] = {
+    "/static/",
+    "/images/",
+    "/favicon.ico",
+    NULL
+};
+
+/*
+    Set while the request being inspected on this thread is buffered, so that
+    its regex evaluation budget carries over to the next inspection. Every
+    connection is handled by a process of its own, and partial requests are
+    always inspected inline by its main thread. A request ends either with an
+    inline verdict other than PROXY_BUFFER or, with ASYNC_INSPECTION, when
+    classify_route() hands the completed request to a worker, and both clear
+    this so that the next request on the connection starts a fresh budget.
+*/
+static __thread int request_buffered = 0;
+
 static int process_client_data(
     const char *client_data,
     int data_size
 );
 
+static int classify_route(
+    const char *client_data,
+    int data_size
+);
+
+static int count_ranges_fast(const char *client_data_string);
+
 /******
  * MAIN
  ******/
 
 int main(int argc, char **argv) {
+    // startup time is logged relative to this
+    reverse_proxy_mark_startup();
+    
     // initialize regexes
     compile_regexes();
+    proxy_stats_name_rules(regex_names, REGEX_NUM);
 
+    if(ASYNC_INSPECTION) {
+        reverse_proxy_async_inspection(classify_route);
+    }
+    
     // start reverse proxy (function does not return)
     reverse_proxy(process_client_data, NULL);
     //reverse_proxy(NULL, NULL);
@@ -90,8 +143,23 @@ static int process_client_data(
     message. If we haven't received the entire HTTP header, return PROXY_BUFFER.
     Else if there's no range header or range header passes inspection, return
     PROXY_ALLOW. Else return PROXY_BLOCK
+
+    Counting ranges with regexes is the expensive part, so while inspection
+    is overloaded and OVERLOAD_POLICY is OVERLOAD_FAIL_OPEN, the ranges are
+    counted by count_ranges_fast() instead.
+
+    If the rules run out of regex evaluation budget, the verdict is
+    REGEX_BUDGET_VERDICT. The budget is started when a new request starts
+    and covers every call made while the request is buffered, so that a
+    client can't get the whole buffer rescanned on a fresh budget by sending
+    it a byte at a time.
 */
     int verdict = PROXY_ALLOW;
+    int exceeded_by;
+    
+    if(!request_buffered) {
+        regex_budget_start();
+    }
 
     char *client_data_string = c_stringify(
         client_data,
@@ -99,7 +167,7 @@ static int process_client_data(
     );
     
     int match_status = match_regex(
-        regexes[REGEX_FULL_HTTP_MSG],
+        REGEX_FULL_HTTP_MSG,
         client_data_string,
         NULL,
         -1
@@ -112,18 +180,30 @@ static int process_client_data(
     else {
     
         match_status = match_regex(
-            regexes[REGEX_HTTP],
+            REGEX_HTTP,
             client_data_string,
             NULL,
             -1
         );
         
+        // fall back to a single pass over the header while overloaded
+        if(match_status == 1 && OVERLOAD_POLICY == OVERLOAD_FAIL_OPEN
+            && overload_active()) {
+            
+            PROXY_STATS_INC(overload_skipped_rules);
+            match_status = 0;
+            
+            if(count_ranges_fast(client_data_string) > MAX_RANGES) {
+                verdict = PROXY_BLOCK;
+            }
+        }
+        
         // if data is HTTP, continue analysis
         if(match_status == 1) {
             
             char *ranges = NULL;
             match_status = match_regex(
-                regexes[REGEX_RANGE_HEADER],
+                REGEX_RANGE_HEADER,
                 client_data_string,
                 &ranges,
                 1
@@ -133,20 +213,128 @@ static int process_client_data(
             // set proxy verdict
             if(match_status == 1 && ranges != NULL) {
                 int range_count = match_regex_count(
-                    regexes[REGEX_RANGE],
+                    REGEX_RANGE,
                     ranges
                 );
                 free(ranges);
                 fprintf(stderr, "Range count: %d\n", range_count);
                 
-                // we don't allow more than 50 ranges in range header
-                if(range_count > 50) {
+                // we don't allow more than MAX_RANGES ranges in range header
+                if(range_count > MAX_RANGES) {
                     verdict = PROXY_BLOCK;
                 }
             }
         }
     }
     
+    // once the budget runs out all further matching fails, so the verdict
+    // above can't be trusted
+    exceeded_by = regex_budget_exceeded_by();
+    if(exceeded_by >= 0) {
+        if(exceeded_by < PROXY_STATS_MAX_RULES) {
+            __sync_fetch_and_add(
+                &proxy_stats->rule_budget_hits[exceeded_by],
+                1
+            );
+        }
+        syslog(
+            LOG_WARNING,
+            "regex %s ran out of evaluation budget\n",
+            regex_names[exceeded_by]
+        );
+        verdict = REGEX_BUDGET_VERDICT;
+    }
+    
+    request_buffered = (verdict == PROXY_BUFFER);
+    
     free(client_data_string);    
     return verdict;
 }
+
+
+static int count_ranges_fast(const char *client_data_string) {
+
+/*
+    Approximates the number of ranges in the Range header of a request, in
+    time linear in the size of the request. REGEX_RANGE matches once per
+    hyphen, so the larger of the number of hyphens and of comma separated
+    specs is returned, which is never less than what the rule counts.
+    Returns 0 if there is no Range header.
+*/
+    
+    const char *line = client_data_string;
+    int specs;
+    int hyphens;
+    
+    while(line != NULL && *line != '\0') {
+        if(strncasecmp(line, "Range:", 6) == 0) {
+            specs = 1;
+            hyphens = 0;
+            for(line += 6; *line != '\0' && *line != '\r' && *line != '\n';
+                line++) {
+                
+                if(*line == ',') {
+                    specs++;
+                }
+                else if(*line == '-') {
+                    hyphens++;
+                }
+            }
+            return hyphens > specs ? hyphens : specs;
+        }
+        
+        line = strchr(line, '\n');
+        if(line != NULL) {
+            line++;
+        }
+    }
+    
+    return 0;
+}
+
+
+static int classify_route(
+    const char *client_data,
+    int data_size) {
+
+/*
+    This is the route_callback function for the reverse_proxy. It returns
+    PROXY_INSPECT_ASYNC if client data is a complete GET or HEAD request for
+    one of low_risk_routes, and PROXY_INSPECT_INLINE otherwise.
+*/
+    
+    const char *path;
+    int path_size;
+    int i;
+    
+    // the whole header has to be there, see REGEX_FULL_HTTP_MSG
+    if(data_size < 4 || memcmp(client_data + data_size - 4, "\r\n\r\n", 4) != 0) {
+        return PROXY_INSPECT_INLINE;
+    }
+    
+    if(data_size > 4 && memcmp(client_data, "GET ", 4) == 0) {
+        path = client_data + 4;
+    }
+    else if(data_size > 5 && memcmp(client_data, "HEAD ", 5) == 0) {
+        path = client_data + 5;
+    }
+    else {
+        return PROXY_INSPECT_INLINE;
+    }
+    
+    path_size = data_size - (path - client_data);
+    
+    for(i = 0; low_risk_routes[i] != NULL; i++) {
+        int route_size = strlen(low_risk_routes[i]);
+        
+        if(route_size <= path_size
+            && memcmp(path, low_risk_routes[i], route_size) == 0) {
+            
+            // the request is complete and no longer inspected on this thread
+            request_buffered = 0;
+            return PROXY_INSPECT_ASYNC;
+        }
+    }
+    
+    return PROXY_INSPECT_INLINE;
+}
@@ -20,16 +20,56 @@
 // adapted from pcredemo.c, which is provided by the PCRE developers
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include "apache_ips_main.h"
 #include "apache_ips_regex.h"
 
+/*
+    Per-request evaluation budget. It is thread-local so that requests
+    inspected concurrently by inspection workers each get their own. Only the
+    time spent in pcre_exec() is charged, so a budget can be carried across
+    several inspections of a request that arrives in pieces.
+*/
+struct regex_budget {
+    int steps_left;
+    int64_t time_left_us;
+    int exceeded_by;    // index of the regex that hit a limit, or -1
+};
+
+static __thread struct regex_budget budget = {
+    REGEX_REQUEST_STEPS,
+    REGEX_REQUEST_TIME_US,
+    -1
+};
+
+static int exec_regex(
+    int regex_index,
+    const char *subject,
+    int subject_length,
+    int start_offset,
+    int options,
+    int *ovector
+);
+
+static uint64_t now_us();
+
 const pcre *regexes[REGEX_NUM] = {
     NULL,
     NULL,
     NULL
 };
 
+// used in log messages
+const char *regex_names[REGEX_NUM] = {
+    "full_http_msg",
+    "http",
+    "range_header",
+    "range"
+};
+
 const char *regex_strings[REGEX_NUM] = {
     "\r\n\r\n$",
     "HTTP\/[0-9]+?\.[0-9]+?[^0-9]",
@@ -37,6 +77,22 @@ const char *regex_strings[REGEX_NUM] = {
     ",?[0-9]*?\-[0-9]*"
 };
 
+static const unsigned long regex_match_limits[REGEX_NUM] = {
+    REGEX_MATCH_LIMIT,
+    REGEX_MATCH_LIMIT,
+    REGEX_MATCH_LIMIT,
+    REGEX_MATCH_LIMIT
+};
+
+static const unsigned long regex_recursion_limits[REGEX_NUM] = {
+    REGEX_RECURSION_LIMIT,
+    REGEX_RECURSION_LIMIT,
+    REGEX_RECURSION_LIMIT,
+    REGEX_RECURSION_LIMIT
+};
+
+static pcre_extra *regex_extras[REGEX_NUM];
+
 
 void compile_regexes() {
     const char *error;
@@ -56,31 +112,59 @@ void compile_regexes() {
             printf("PCRE compilation failed at offset %d: %s\n", erroffset, error);
             exit(1);
         }
+        
+        /* Study the pattern, and attach its evaluation limits */
+        regex_extras[i] = pcre_study(regexes[i], 0, &error);
+        if (regex_extras[i] == NULL) {
+            regex_extras[i] = calloc(1, sizeof(pcre_extra));
+            if (regex_extras[i] == NULL) {
+                printf("pcre_extra allocation failed\n");
+                exit(1);
+            }
+        }
+        regex_extras[i]->flags |= PCRE_EXTRA_MATCH_LIMIT
+            | PCRE_EXTRA_MATCH_LIMIT_RECURSION;
+        regex_extras[i]->match_limit = regex_match_limits[i];
+        regex_extras[i]->match_limit_recursion = regex_recursion_limits[i];
     }
 }
 
-int match_regex(const pcre *regex,
+void regex_budget_start() {
+// start a new per-request evaluation budget for the calling thread
+    budget.steps_left = REGEX_REQUEST_STEPS;
+    budget.time_left_us = REGEX_REQUEST_TIME_US;
+    budget.exceeded_by = -1;
+}
+
+int regex_budget_exceeded_by() {
+//return index of the regex that exhausted the current budget, -1 if none
+    return budget.exceeded_by;
+}
+
+int match_regex(int regex_index,
                             const char *subject,
                             char **sub_expr,
                             int sub_expr_index) {
 //return 1 regex matches subject,
-// 0 otherwise
+// 0 otherwise, REGEX_BUDGET_EXCEEDED if the evaluation budget ran out
 // place pointer to ovector[sub_expr_index] into *sub_expr if sub_expr_index>0
 // make sure to free pointer returned
     int ovector[OVECCOUNT];
     int subject_length = (int) strlen(subject);
-    int rc = pcre_exec(
-                regex,                /* the compiled pattern */
-                NULL,                 /* no extra data - we didn't study the pattern */
+    int rc = exec_regex(
+                regex_index,          /* the compiled pattern */
                 subject,              /* the subject string */
                 subject_length,       /* the length of the subject */
                 0,                    /* start at offset 0 in the subject */
                 0,                    /* default options */
-                ovector,              /* output vector for substring information */
-                OVECCOUNT);           /* number of elements in the output vector */
+                ovector);             /* output vector for substring information */
 
     /* Matching failed: handle error cases */
 
+    if(budget.exceeded_by >= 0) {
+        return REGEX_BUDGET_EXCEEDED;
+    }
+
     if(rc < 0) {
         return 0;
     }
@@ -101,23 +185,26 @@ int match_regex(const pcre *regex,
     return 1;
 }
 
-int match_regex_count(const pcre *regex, const char *subject) {
-//return number of times regex matches subject, 0 if no match
+int match_regex_count(int regex_index, const char *subject) {
+//return number of times regex matches subject, 0 if no match,
+//REGEX_BUDGET_EXCEEDED if the evaluation budget ran out
 
     int ovector[OVECCOUNT];
     int subject_length = (int) strlen(subject);
-    int rc = pcre_exec(
-                regex,                /* the compiled pattern */
-                NULL,                 /* no extra data - we didn't study the pattern */
+    int rc = exec_regex(
+                regex_index,          /* the compiled pattern */
                 subject,              /* the subject string */
                 subject_length,       /* the length of the subject */
                 0,                    /* start at offset 0 in the subject */
                 0,                    /* default options */
-                ovector,              /* output vector for substring information */
-                OVECCOUNT);           /* number of elements in the output vector */
+                ovector);             /* output vector for substring information */
 
     /* Matching failed: handle error cases */
 
+    if(budget.exceeded_by >= 0) {
+        return REGEX_BUDGET_EXCEEDED;
+    }
+
     if(rc < 0) {
         return 0;
     }
@@ -140,15 +227,19 @@ int match_regex_count(const pcre *regex, const char *subject) {
 
         /* Run the next matching operation */
 
-        rc = pcre_exec(
-              regex,                   /* the compiled pattern */
-              NULL,                 /* no extra data - we didn't study the pattern */
+        rc = exec_regex(
+              regex_index,          /* the compiled pattern */
               subject,              /* the subject string */
               subject_length,       /* the length of the subject */
               start_offset,         /* starting offset in the subject */
               options,              /* options */
-              ovector,              /* output vector for substring information */
-              OVECCOUNT);           /* number of elements in the output vector */
+              ovector);             /* output vector for substring information */
+
+        /* The evaluation budget ran out, the count is incomplete */
+
+        if (budget.exceeded_by >= 0) {
+            return REGEX_BUDGET_EXCEEDED;
+        }
 
         /* This time, a result of NOMATCH isn't an error. If the value in "options"
         is zero, it just means we have found all possible matches, so the loop ends.
@@ -181,3 +272,48 @@ int match_regex_count(const pcre *regex, const char *subject) {
     return match_count;
 }
 
+static int exec_regex(int regex_index,
+                            const char *subject,
+                            int subject_length,
+                            int start_offset,
+                            int options,
+                            int *ovector) {
+//run pcre_exec() within the pattern limits and the per-request budget
+//sets budget.exceeded_by and returns PCRE_ERROR_MATCHLIMIT once a limit is hit
+    if(budget.exceeded_by >= 0) {
+        return PCRE_ERROR_MATCHLIMIT;
+    }
+
+    if(budget.steps_left <= 0) {
+        budget.exceeded_by = regex_index;
+        return PCRE_ERROR_MATCHLIMIT;
+    }
+    budget.steps_left--;
+
+    uint64_t start = now_us();
+    int rc = pcre_exec(
+                regexes[regex_index],       /* the compiled pattern */
+                regex_extras[regex_index],  /* study data and limits */
+                subject,              /* the subject string */
+                subject_length,       /* the length of the subject */
+                start_offset,         /* starting offset in the subject */
+                options,              /* options */
+                ovector,              /* output vector for substring information */
+                OVECCOUNT);           /* number of elements in the output vector */
+
+    budget.time_left_us -= now_us() - start;
+
+    if(rc == PCRE_ERROR_MATCHLIMIT || rc == PCRE_ERROR_RECURSIONLIMIT
+        || budget.time_left_us < 0) {
+        budget.exceeded_by = regex_index;
+        return PCRE_ERROR_MATCHLIMIT;
+    }
+
+    return rc;
+}
+
+static uint64_t now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
@@ -30,22 +30,54 @@
 #define REGEX_RANGE 3
 #define OVECCOUNT 30    /* should be a multiple of 3 */
 
+/*
+    Evaluation budgets. Each pattern has a PCRE match limit and recursion
+    limit, see regex_match_limits and regex_recursion_limits. On top of that,
+    all pcre_exec() calls made on a thread between two regex_budget_start()
+    calls share a budget of REGEX_REQUEST_STEPS calls taking
+    REGEX_REQUEST_TIME_US microseconds in total. Once any limit is hit,
+    matching functions return REGEX_BUDGET_EXCEEDED until the next
+    regex_budget_start().
+*/
+#ifndef REGEX_MATCH_LIMIT
+#define REGEX_MATCH_LIMIT 100000
+#endif
+
+#ifndef REGEX_RECURSION_LIMIT
+#define REGEX_RECURSION_LIMIT 5000
+#endif
+
+#ifndef REGEX_REQUEST_STEPS
+#define REGEX_REQUEST_STEPS 2000
+#endif
+
+#ifndef REGEX_REQUEST_TIME_US
+#define REGEX_REQUEST_TIME_US 10000
+#endif
+
+#define REGEX_BUDGET_EXCEEDED -1
+
 
 extern const pcre *regexes[REGEX_NUM];
 extern const char *regex_strings[REGEX_NUM];
+extern const char *regex_names[REGEX_NUM];
 
 
 void compile_regexes();
 
+void regex_budget_start();
+
+int regex_budget_exceeded_by();
+
 int match_regex(
-    const pcre *regex,
+    int regex_index,
     const char *subject,
     char **sub_expr,
     int sub_expr_index
 );
 
 int match_regex_count(
-    const pcre *regex,
+    int regex_index,
     const char *subject
 );
 
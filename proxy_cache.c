@@ -0,0 +1,1152 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#define _GNU_SOURCE     // for strptime() and timegm()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>    // for strncasecmp()
+#include <ctype.h>      // for tolower()
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>     // for getpid() and usleep()
+#include <pthread.h>
+#include <sys/mman.h>   // for mmap()
+#include "proxy_cache.h"
+#include "proxy_stats.h"
+#include "proxy_timer.h"
+
+/*********
+ * DEFINES
+ *********/
+
+#define CACHE_KEY_MAX 1024
+#define CACHE_VARY_MAX 1024
+#define CACHE_HEADER_VALUE_MAX 256
+#define CACHE_AGE_LINE_MAX 32
+#define CACHE_WAIT_STEP_MS 5
+
+#define CACHE_EMPTY     0
+#define CACHE_FILLING   1
+#define CACHE_READY     2
+#define CACHE_PASS      3   // response not cacheable until expires
+
+/*********
+ * STRUCTS
+ *********/
+
+/*
+    A cache slot. data holds the key, then the Vary lines ("name: value\r\n"
+    for each request header named by Vary), then the response without its Age
+    header, which copy_response() adds back with the current age.
+*/
+struct cache_entry {
+    uint64_t hash;
+    int state;
+    int referenced;             // CLOCK reference bit
+    pid_t filler;               // handler fetching a CACHE_FILLING entry
+    uint64_t claim_time;        // when filling or revalidation started, in ms
+    int revalidating;
+    uint64_t expires;           // timer_now_ms() time the entry goes stale
+                                // or a CACHE_PASS entry ends
+    uint64_t stale_until;       // end of the stale-while-revalidate period
+    uint64_t stored_time;       // timer_now_ms() time the response was stored
+    long initial_age;           // age of the response when stored, in s
+    int key_size;
+    int vary_size;
+    int response_size;
+    char data[];
+};
+
+struct cache_shard {
+    pthread_mutex_t lock;
+    int clock_hand;
+};
+
+struct response_policy {
+    int cacheable;
+    long fresh_s;               // freshness lifetime
+    long stale_s;               // stale-while-revalidate period
+    long age_s;                 // Age the response came with
+};
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+static struct cache_shard *shards = NULL;
+static char *slots = NULL;
+
+static size_t slot_stride();
+
+static struct cache_entry *slot_entry(
+    int shard_index,
+    int slot_index
+);
+
+static void lock_shard(struct cache_shard *shard);
+
+static int request_key(
+    const char *request,
+    int request_size,
+    char *key
+);
+
+static uint64_t hash_key(
+    const char *key,
+    int key_size
+);
+
+static struct cache_entry *find_entry(
+    int shard_index,
+    uint64_t hash,
+    const char *key,
+    int key_size
+);
+
+static struct cache_entry *clock_evict(int shard_index);
+
+static void claim_entry(
+    struct cache_entry *entry,
+    uint64_t hash,
+    const char *key,
+    int key_size
+);
+
+static int copy_response(
+    const struct cache_entry *entry,
+    uint64_t now,
+    char **response,
+    int *response_size
+);
+
+static int header_end(
+    const char *message,
+    int message_size
+);
+
+static const char *find_header(
+    const char *message,
+    int header_size,
+    const char *name,
+    int *value_size
+);
+
+static void copy_lower(
+    char *dest,
+    const char *src,
+    int src_size
+);
+
+static long directive_value(
+    const char *cache_control,
+    const char *directive
+);
+
+static time_t parse_http_date(
+    const char *value,
+    int value_size
+);
+
+static void response_policy(
+    const char *response,
+    int header_size,
+    struct response_policy *policy
+);
+
+static int build_vary(
+    const char *response,
+    int response_header_size,
+    const char *request,
+    int request_header_size,
+    char *vary
+);
+
+static int vary_matches(
+    const struct cache_entry *entry,
+    const char *request,
+    int request_header_size
+);
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+void cache_init() {
+
+    // must be called before any child process is forked
+    
+    pthread_mutexattr_t lock_attr;
+    size_t shards_size = CACHE_SHARDS * sizeof(struct cache_shard);
+    size_t slots_size =
+        (size_t) CACHE_SHARDS * CACHE_SLOTS_PER_SHARD * slot_stride();
+    int i;
+    
+    shards = mmap(
+        NULL,
+        shards_size + slots_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    
+    if(shards == MAP_FAILED) {
+        perror("mmap() failed");
+        exit(1);
+    }
+    
+    slots = (char *) shards + shards_size;
+    
+    // robust locks, so a handler that dies holding one doesn't wedge a shard
+    pthread_mutexattr_init(&lock_attr);
+    pthread_mutexattr_setpshared(&lock_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&lock_attr, PTHREAD_MUTEX_ROBUST);
+    
+    for(i = 0; i < CACHE_SHARDS; i++) {
+        pthread_mutex_init(&shards[i].lock, &lock_attr);
+    }
+    
+    pthread_mutexattr_destroy(&lock_attr);
+}
+
+int cache_lookup(
+    const char *request,
+    int request_size,
+    char **response,
+    int *response_size) {
+
+/*
+    Looks up the response to request, which must be a complete request header
+    without a body. On CACHE_HIT and CACHE_STALE, *response is set to a copy of
+    the cached response, which the caller must free. On CACHE_STALE the caller
+    is also responsible for refreshing the entry, and on CACHE_MISS for
+    fetching it; either way it must end with cache_store(), cache_abandon() or
+    cache_pass().
+*/
+    
+    char key[CACHE_KEY_MAX];
+    int key_size = request_key(request, request_size, key);
+    uint64_t hash;
+    int shard_index;
+    struct cache_shard *shard;
+    struct cache_entry *entry;
+    int coalesced = 0;
+    int result;
+    
+    if(key_size < 0) {
+        PROXY_STATS_INC(cache_bypasses);
+        return CACHE_BYPASS;
+    }
+    
+    hash = hash_key(key, key_size);
+    shard_index = hash % CACHE_SHARDS;
+    shard = &shards[shard_index];
+    
+    for(;;) {
+        lock_shard(shard);
+        entry = find_entry(shard_index, hash, key, key_size);
+        
+        // another handler is fetching this response, wait for it
+        if(entry != NULL && entry->state == CACHE_FILLING
+            && timer_now_ms() - entry->claim_time < CACHE_FILL_WAIT_MS) {
+            
+            pthread_mutex_unlock(&shard->lock);
+            coalesced = 1;
+            usleep(CACHE_WAIT_STEP_MS * 1000);
+            continue;
+        }
+        
+        break;
+    }
+    
+    // known not to be cacheable
+    if(entry != NULL && entry->state == CACHE_PASS
+        && timer_now_ms() < entry->expires) {
+        
+        entry->referenced = 1;
+        pthread_mutex_unlock(&shard->lock);
+        PROXY_STATS_INC(cache_passes);
+        return CACHE_BYPASS;
+    }
+    
+    if(entry != NULL && entry->state == CACHE_READY
+        && vary_matches(entry, request, request_size)) {
+        
+        uint64_t now = timer_now_ms();
+        
+        if(now < entry->expires) {
+            result = CACHE_HIT;
+        }
+        else if(now < entry->stale_until) {
+            // only one handler refreshes a stale entry at a time
+            result = CACHE_HIT;
+            if(!entry->revalidating
+                || now - entry->claim_time >= CACHE_FILL_WAIT_MS) {
+                
+                entry->revalidating = 1;
+                entry->claim_time = now;
+                result = CACHE_STALE;
+            }
+        }
+        else {
+            result = CACHE_MISS;
+        }
+        
+        if(result != CACHE_MISS) {
+            int stale = (now >= entry->expires);
+            
+            entry->referenced = 1;
+            if(!copy_response(entry, now, response, response_size)) {
+                entry->revalidating = 0;
+                pthread_mutex_unlock(&shard->lock);
+                PROXY_STATS_INC(cache_bypasses);
+                return CACHE_BYPASS;
+            }
+            pthread_mutex_unlock(&shard->lock);
+            
+            if(stale) {
+                PROXY_STATS_INC(cache_stale_hits);
+            }
+            else {
+                PROXY_STATS_INC(cache_hits);
+            }
+            if(coalesced) {
+                PROXY_STATS_INC(cache_coalesced);
+            }
+            return result;
+        }
+    }
+    
+    // miss: claim the entry so that other handlers wait for this one
+    if(entry == NULL) {
+        entry = clock_evict(shard_index);
+    }
+    
+    if(entry == NULL) {
+        result = CACHE_BYPASS;
+        PROXY_STATS_INC(cache_bypasses);
+    }
+    else {
+        claim_entry(entry, hash, key, key_size);
+        result = CACHE_MISS;
+        PROXY_STATS_INC(cache_misses);
+    }
+    
+    pthread_mutex_unlock(&shard->lock);
+    return result;
+}
+
+int cache_response_size(
+    const char *response,
+    int response_size) {
+
+/*
+    Returns the full size of the response that starts at response if it can
+    be cached and its size is known from its header, 0 if more data is needed
+    to tell, or -1 if it can't be cached. Whether it can be cached depends on
+    the Vary header too, which is only checked by cache_store().
+*/
+    
+    int header_size = header_end(response, response_size);
+    const char *value;
+    int value_size;
+    char number[CACHE_HEADER_VALUE_MAX];
+    long content_length;
+    struct response_policy policy;
+    
+    if(header_size < 0) {
+        return response_size >= CACHE_OBJECT_MAX ? -1 : 0;
+    }
+    
+    if(header_size < 13
+        || (strncmp(response, "HTTP/1.1 200 ", 13) != 0
+        && strncmp(response, "HTTP/1.0 200 ", 13) != 0)) {
+        
+        return -1;
+    }
+    
+    if(find_header(response, header_size, "Transfer-Encoding", &value_size)
+        != NULL) {
+        
+        return -1;
+    }
+    
+    value = find_header(response, header_size, "Content-Length", &value_size);
+    if(value == NULL || value_size >= CACHE_HEADER_VALUE_MAX) {
+        return -1;
+    }
+    
+    copy_lower(number, value, value_size);
+    content_length = strtol(number, NULL, 10);
+    
+    if(content_length < 0
+        || content_length > CACHE_OBJECT_MAX - header_size) {
+        
+        return -1;
+    }
+    
+    response_policy(response, header_size, &policy);
+    if(!policy.cacheable) {
+        return -1;
+    }
+    
+    return header_size + content_length;
+}
+
+void cache_store(
+    const char *request,
+    int request_size,
+    const char *response,
+    int response_size) {
+
+/*
+    Stores a complete response to request if its headers allow it, and ends
+    the fill or refresh started by cache_lookup().
+*/
+    
+    char key[CACHE_KEY_MAX];
+    char vary[CACHE_VARY_MAX];
+    int key_size = request_key(request, request_size, key);
+    int header_size = header_end(response, response_size);
+    int vary_size;
+    struct response_policy policy;
+    const char *age;
+    int age_size;
+    int age_line = 0;           // offset and size of the Age header line
+    int age_line_size = 0;
+    uint64_t hash;
+    int shard_index;
+    struct cache_entry *entry;
+    uint64_t now = timer_now_ms();
+    long fresh_s;
+    
+    if(key_size < 0 || header_size < 0) {
+        cache_abandon(request, request_size);
+        return;
+    }
+    
+    response_policy(response, header_size, &policy);
+    vary_size = build_vary(
+        response,
+        header_size,
+        request,
+        request_size,
+        vary
+    );
+    
+    if(!policy.cacheable || vary_size < 0
+        || key_size + vary_size + response_size > CACHE_OBJECT_MAX) {
+        
+        cache_pass(request, request_size);
+        return;
+    }
+    
+    // the Age header is left out of the stored response and rebuilt on hits
+    age = find_header(response, header_size, "Age", &age_size);
+    if(age != NULL) {
+        const char *line_end = memchr(age, '\n', response + header_size - age);
+        
+        age_line = age - response;
+        while(response[age_line - 1] != '\n') {
+            age_line--;
+        }
+        age_line_size = line_end + 1 - (response + age_line);
+    }
+    
+    // the lifetime counts from when the response was generated
+    fresh_s = policy.fresh_s - policy.age_s;
+    if(fresh_s < 0) {
+        fresh_s = 0;
+    }
+    
+    hash = hash_key(key, key_size);
+    shard_index = hash % CACHE_SHARDS;
+    
+    lock_shard(&shards[shard_index]);
+    
+    // the entry may have been evicted while the response was being fetched
+    entry = find_entry(shard_index, hash, key, key_size);
+    if(entry == NULL) {
+        entry = clock_evict(shard_index);
+    }
+    
+    if(entry != NULL) {
+        memcpy(entry->data, key, key_size);
+        memcpy(entry->data + key_size, vary, vary_size);
+        memcpy(entry->data + key_size + vary_size, response, age_line);
+        memcpy(
+            entry->data + key_size + vary_size + age_line,
+            response + age_line + age_line_size,
+            response_size - age_line - age_line_size
+        );
+        
+        entry->hash = hash;
+        entry->key_size = key_size;
+        entry->vary_size = vary_size;
+        entry->response_size = response_size - age_line_size;
+        entry->stored_time = now;
+        entry->initial_age = policy.age_s;
+        entry->expires = now + fresh_s * 1000;
+        entry->stale_until = entry->expires + policy.stale_s * 1000;
+        entry->revalidating = 0;
+        entry->referenced = 1;
+        entry->state = CACHE_READY;
+        
+        PROXY_STATS_INC(cache_stores);
+    }
+    
+    pthread_mutex_unlock(&shards[shard_index].lock);
+}
+
+void cache_abandon(
+    const char *request,
+    int request_size) {
+
+    // ends a fill or refresh started by cache_lookup() without storing
+    
+    char key[CACHE_KEY_MAX];
+    int key_size = request_key(request, request_size, key);
+    uint64_t hash;
+    int shard_index;
+    struct cache_entry *entry;
+    
+    if(key_size < 0) {
+        return;
+    }
+    
+    hash = hash_key(key, key_size);
+    shard_index = hash % CACHE_SHARDS;
+    
+    lock_shard(&shards[shard_index]);
+    
+    entry = find_entry(shard_index, hash, key, key_size);
+    if(entry != NULL) {
+        if(entry->state == CACHE_FILLING && entry->filler == getpid()) {
+            entry->state = CACHE_EMPTY;
+        }
+        else if(entry->state == CACHE_READY) {
+            entry->revalidating = 0;
+        }
+    }
+    
+    pthread_mutex_unlock(&shards[shard_index].lock);
+}
+
+void cache_pass(
+    const char *request,
+    int request_size) {
+
+/*
+    Ends a fill or refresh started by cache_lookup() because the response
+    can't be cached, and marks the key as such for CACHE_PASS_MS.
+*/
+    
+    char key[CACHE_KEY_MAX];
+    int key_size = request_key(request, request_size, key);
+    uint64_t hash;
+    int shard_index;
+    struct cache_entry *entry;
+    
+    if(key_size < 0) {
+        return;
+    }
+    
+    hash = hash_key(key, key_size);
+    shard_index = hash % CACHE_SHARDS;
+    
+    lock_shard(&shards[shard_index]);
+    
+    entry = find_entry(shard_index, hash, key, key_size);
+    if(entry != NULL
+        && ((entry->state == CACHE_FILLING && entry->filler == getpid())
+        || (entry->state == CACHE_READY && entry->revalidating))) {
+        
+        entry->vary_size = 0;
+        entry->response_size = 0;
+        entry->revalidating = 0;
+        entry->expires = timer_now_ms() + CACHE_PASS_MS;
+        entry->state = CACHE_PASS;
+    }
+    
+    pthread_mutex_unlock(&shards[shard_index].lock);
+}
+
+static size_t slot_stride() {
+    size_t stride = sizeof(struct cache_entry) + CACHE_OBJECT_MAX;
+    return (stride + 7) & ~(size_t) 7;
+}
+
+static struct cache_entry *slot_entry(
+    int shard_index,
+    int slot_index) {
+    
+    size_t slot = (size_t) shard_index * CACHE_SLOTS_PER_SHARD + slot_index;
+    return (struct cache_entry *) (slots + slot * slot_stride());
+}
+
+static void lock_shard(struct cache_shard *shard) {
+
+    // the slots of a dead owner are at worst stale or abandoned, both of which
+    // are handled, so the lock can simply be marked consistent again
+    
+    if(pthread_mutex_lock(&shard->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&shard->lock);
+    }
+}
+
+static int request_key(
+    const char *request,
+    int request_size,
+    char *key) {
+
+/*
+    Builds the cache key (host and request target) of a request into key,
+    which must hold CACHE_KEY_MAX bytes. Returns the key size, or -1 if the
+    request is not a complete, cacheable GET request.
+*/
+    
+    const char *target;
+    const char *target_end;
+    const char *host;
+    const char *value;
+    int host_size;
+    int target_size;
+    int value_size;
+    char directives[CACHE_HEADER_VALUE_MAX];
+    
+    if(request_size < 4 || strncmp(request, "GET ", 4) != 0
+        || header_end(request, request_size) != request_size) {
+        
+        return -1;
+    }
+    
+    target = request + 4;
+    target_end = memchr(target, ' ', request_size - 4);
+    if(target_end == NULL) {
+        return -1;
+    }
+    target_size = target_end - target;
+    
+    // responses to authenticated requests are private
+    if(find_header(request, request_size, "Authorization", &value_size)
+        != NULL) {
+        
+        return -1;
+    }
+    
+    // the client asked not to be served from a cache
+    value = find_header(request, request_size, "Cache-Control", &value_size);
+    if(value != NULL) {
+        if(value_size >= CACHE_HEADER_VALUE_MAX) {
+            return -1;
+        }
+        copy_lower(directives, value, value_size);
+        if(directive_value(directives, "no-cache") >= 0
+            || directive_value(directives, "no-store") >= 0) {
+            
+            return -1;
+        }
+    }
+    
+    if(find_header(request, request_size, "Pragma", &value_size) != NULL) {
+        return -1;
+    }
+    
+    host = find_header(request, request_size, "Host", &host_size);
+    if(host == NULL) {
+        host = "";
+        host_size = 0;
+    }
+    
+    if(host_size + 1 + target_size > CACHE_KEY_MAX) {
+        return -1;
+    }
+    
+    memcpy(key, host, host_size);
+    key[host_size] = ' ';
+    memcpy(key + host_size + 1, target, target_size);
+    return host_size + 1 + target_size;
+}
+
+static uint64_t hash_key(
+    const char *key,
+    int key_size) {
+
+    // 64 bit FNV-1a
+    
+    uint64_t hash = 14695981039346656037ULL;
+    int i;
+    
+    for(i = 0; i < key_size; i++) {
+        hash ^= (unsigned char) key[i];
+        hash *= 1099511628211ULL;
+    }
+    
+    return hash;
+}
+
+static struct cache_entry *find_entry(
+    int shard_index,
+    uint64_t hash,
+    const char *key,
+    int key_size) {
+
+    // the shard lock must be held
+    
+    int i;
+    
+    for(i = 0; i < CACHE_SLOTS_PER_SHARD; i++) {
+        struct cache_entry *entry = slot_entry(shard_index, i);
+        
+        if(entry->state != CACHE_EMPTY && entry->hash == hash
+            && entry->key_size == key_size
+            && memcmp(entry->data, key, key_size) == 0) {
+            
+            return entry;
+        }
+    }
+    
+    return NULL;
+}
+
+static struct cache_entry *clock_evict(int shard_index) {
+
+/*
+    Finds a slot for a new entry, evicting the first entry the CLOCK hand
+    finds without its reference bit set. Entries being filled are skipped
+    unless their fill was abandoned. Returns NULL if no slot could be freed.
+    The shard lock must be held.
+*/
+    
+    struct cache_shard *shard = &shards[shard_index];
+    uint64_t now = timer_now_ms();
+    int i;
+    
+    for(i = 0; i < 2 * CACHE_SLOTS_PER_SHARD; i++) {
+        struct cache_entry *entry = slot_entry(shard_index, shard->clock_hand);
+        shard->clock_hand = (shard->clock_hand + 1) % CACHE_SLOTS_PER_SHARD;
+        
+        if(entry->state == CACHE_EMPTY) {
+            return entry;
+        }
+        
+        if(entry->state == CACHE_FILLING
+            && now - entry->claim_time < CACHE_FILL_WAIT_MS) {
+            
+            continue;
+        }
+        
+        if(entry->referenced) {
+            entry->referenced = 0;
+            continue;
+        }
+        
+        if(entry->state == CACHE_READY) {
+            PROXY_STATS_INC(cache_evictions);
+        }
+        
+        entry->state = CACHE_EMPTY;
+        return entry;
+    }
+    
+    return NULL;
+}
+
+static void claim_entry(
+    struct cache_entry *entry,
+    uint64_t hash,
+    const char *key,
+    int key_size) {
+    
+    memcpy(entry->data, key, key_size);
+    entry->hash = hash;
+    entry->key_size = key_size;
+    entry->vary_size = 0;
+    entry->response_size = 0;
+    entry->filler = getpid();
+    entry->claim_time = timer_now_ms();
+    entry->revalidating = 0;
+    entry->referenced = 1;
+    entry->state = CACHE_FILLING;
+}
+
+static int copy_response(
+    const struct cache_entry *entry,
+    uint64_t now,
+    char **response,
+    int *response_size) {
+
+/*
+    Copies the cached response out with an Age header inserted after the
+    status line, so that clients and downstream caches count the lifetime of
+    the response from when it was generated rather than from this hit.
+*/
+    
+    const char *stored = entry->data + entry->key_size + entry->vary_size;
+    const char *status_end = memchr(stored, '\n', entry->response_size);
+    int status_size = status_end + 1 - stored;
+    char age_line[CACHE_AGE_LINE_MAX];
+    int age_line_size = snprintf(
+        age_line,
+        sizeof(age_line),
+        "Age: %ld\r\n",
+        entry->initial_age + (long) ((now - entry->stored_time) / 1000)
+    );
+    
+    *response = malloc(entry->response_size + age_line_size);
+    if(*response == NULL) {
+        return 0;
+    }
+    
+    memcpy(*response, stored, status_size);
+    memcpy(*response + status_size, age_line, age_line_size);
+    memcpy(
+        *response + status_size + age_line_size,
+        stored + status_size,
+        entry->response_size - status_size
+    );
+    *response_size = entry->response_size + age_line_size;
+    return 1;
+}
+
+static int header_end(
+    const char *message,
+    int message_size) {
+
+    // returns the size of the header of message, or -1 if it isn't complete
+    
+    int i;
+    
+    for(i = 3; i < message_size; i++) {
+        if(message[i] == '\n' && message[i - 1] == '\r'
+            && message[i - 2] == '\n' && message[i - 3] == '\r') {
+            
+            return i + 1;
+        }
+    }
+    
+    return -1;
+}
+
+static const char *find_header(
+    const char *message,
+    int header_size,
+    const char *name,
+    int *value_size) {
+
+/*
+    Returns a pointer to the value of header field name in the header of
+    message, with its size in *value_size, or NULL if there is no such field.
+    The first line of message (request or status line) is skipped.
+*/
+    
+    int name_size = strlen(name);
+    const char *end = message + header_size;
+    const char *line = memchr(message, '\n', header_size);
+    
+    while(line != NULL && ++line < end) {
+        const char *line_end = memchr(line, '\n', end - line);
+        if(line_end == NULL) {
+            break;
+        }
+        
+        if(line_end - line > name_size && line[name_size] == ':'
+            && strncasecmp(line, name, name_size) == 0) {
+            
+            const char *value = line + name_size + 1;
+            const char *value_end = line_end;
+            
+            while(value < value_end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            while(value_end > value && isspace((unsigned char) value_end[-1])) {
+                value_end--;
+            }
+            
+            *value_size = value_end - value;
+            return value;
+        }
+        
+        line = line_end;
+    }
+    
+    return NULL;
+}
+
+static void copy_lower(
+    char *dest,
+    const char *src,
+    int src_size) {
+
+    // copies src to a null terminated, lower case string in dest
+    
+    int i;
+    
+    for(i = 0; i < src_size; i++) {
+        dest[i] = tolower((unsigned char) src[i]);
+    }
+    dest[src_size] = '\0';
+}
+
+static long directive_value(
+    const char *cache_control,
+    const char *directive) {
+
+/*
+    Looks up directive in a lower case Cache-Control value. Returns -1 if it
+    isn't there, its numeric argument if it has one, and 0 otherwise.
+*/
+    
+    int directive_size = strlen(directive);
+    const char *found = cache_control;
+    
+    while((found = strstr(found, directive)) != NULL) {
+        const char *after = found + directive_size;
+        
+        if((found == cache_control || found[-1] == ' ' || found[-1] == ',')
+            && (*after == '\0' || *after == ' ' || *after == ','
+            || *after == '=')) {
+            
+            return *after == '=' ? strtol(after + 1, NULL, 10) : 0;
+        }
+        
+        found = after;
+    }
+    
+    return -1;
+}
+
+static time_t parse_http_date(
+    const char *value,
+    int value_size) {
+
+    // parses an IMF-fixdate, returns -1 on failure
+    
+    char date[CACHE_HEADER_VALUE_MAX];
+    struct tm tm;
+    
+    if(value_size >= CACHE_HEADER_VALUE_MAX) {
+        return -1;
+    }
+    
+    memcpy(date, value, value_size);
+    date[value_size] = '\0';
+    memset(&tm, 0, sizeof(tm));
+    
+    if(strptime(date, "%a, %d %b %Y %H:%M:%S GMT", &tm) == NULL) {
+        return -1;
+    }
+    
+    return timegm(&tm);
+}
+
+static void response_policy(
+    const char *response,
+    int header_size,
+    struct response_policy *policy) {
+
+/*
+    Works out from the header of a response whether it may be stored, and for
+    how long. Responses without an explicit lifetime are not stored.
+*/
+    
+    char directives[CACHE_HEADER_VALUE_MAX] = "";
+    char number[CACHE_HEADER_VALUE_MAX];
+    const char *value;
+    int value_size;
+    long max_age;
+    
+    policy->cacheable = 0;
+    policy->fresh_s = -1;
+    policy->stale_s = 0;
+    policy->age_s = 0;
+    
+    value = find_header(response, header_size, "Age", &value_size);
+    if(value != NULL && value_size < CACHE_HEADER_VALUE_MAX) {
+        copy_lower(number, value, value_size);
+        policy->age_s = strtol(number, NULL, 10);
+        if(policy->age_s < 0) {
+            policy->age_s = 0;
+        }
+    }
+    
+    if(find_header(response, header_size, "Set-Cookie", &value_size) != NULL) {
+        return;
+    }
+    
+    value = find_header(response, header_size, "Cache-Control", &value_size);
+    if(value != NULL) {
+        if(value_size >= CACHE_HEADER_VALUE_MAX) {
+            return;
+        }
+        copy_lower(directives, value, value_size);
+    }
+    
+    if(directive_value(directives, "no-store") >= 0
+        || directive_value(directives, "no-cache") >= 0
+        || directive_value(directives, "private") >= 0) {
+        
+        return;
+    }
+    
+    if((max_age = directive_value(directives, "s-maxage")) >= 0
+        || (max_age = directive_value(directives, "max-age")) >= 0) {
+        
+        policy->fresh_s = max_age;
+    }
+    else if((value = find_header(response, header_size, "Expires",
+        &value_size)) != NULL) {
+        
+        time_t expires = parse_http_date(value, value_size);
+        time_t date = time(NULL);
+        
+        value = find_header(response, header_size, "Date", &value_size);
+        if(value != NULL && parse_http_date(value, value_size) >= 0) {
+            date = parse_http_date(value, value_size);
+        }
+        
+        // an invalid Expires means already expired
+        policy->fresh_s = expires < date ? 0 : expires - date;
+    }
+    
+    policy->stale_s = directive_value(directives, "stale-while-revalidate");
+    if(policy->stale_s < 0) {
+        policy->stale_s = 0;
+    }
+    
+    policy->cacheable = policy->fresh_s > 0
+        || (policy->fresh_s == 0 && policy->stale_s > 0);
+}
+
+static int build_vary(
+    const char *response,
+    int response_header_size,
+    const char *request,
+    int request_header_size,
+    char *vary) {
+
+/*
+    Writes a "name: value\r\n" line to vary for each request header named by
+    the Vary header of the response, using an empty value for headers missing
+    from the request. Returns the number of bytes written, or -1 if the
+    response varies on everything or the lines don't fit in CACHE_VARY_MAX.
+*/
+    
+    const char *names;
+    int names_size;
+    int vary_size = 0;
+    int i = 0;
+    
+    names = find_header(response, response_header_size, "Vary", &names_size);
+    if(names == NULL) {
+        return 0;
+    }
+    
+    while(i < names_size) {
+        char name[CACHE_HEADER_VALUE_MAX];
+        int name_size = 0;
+        const char *value;
+        int value_size;
+        
+        while(i < names_size && (names[i] == ' ' || names[i] == ',')) {
+            i++;
+        }
+        while(i < names_size && names[i] != ' ' && names[i] != ','
+            && name_size < CACHE_HEADER_VALUE_MAX - 1) {
+            
+            name[name_size++] = names[i++];
+        }
+        name[name_size] = '\0';
+        
+        if(name_size == 0) {
+            continue;
+        }
+        
+        if(strcmp(name, "*") == 0) {
+            return -1;
+        }
+        
+        value = find_header(request, request_header_size, name, &value_size);
+        if(value == NULL) {
+            value = "";
+            value_size = 0;
+        }
+        
+        if(vary_size + name_size + value_size + 4 > CACHE_VARY_MAX) {
+            return -1;
+        }
+        
+        vary_size += sprintf(
+            vary + vary_size,
+            "%s: %.*s\r\n",
+            name,
+            value_size,
+            value
+        );
+    }
+    
+    return vary_size;
+}
+
+static int vary_matches(
+    const struct cache_entry *entry,
+    const char *request,
+    int request_header_size) {
+
+    // checks the request against the Vary lines stored with an entry
+    
+    const char *line = entry->data + entry->key_size;
+    const char *end = line + entry->vary_size;
+    
+    while(line < end) {
+        const char *colon = memchr(line, ':', end - line);
+        const char *line_end = memchr(line, '\r', end - line);
+        char name[CACHE_HEADER_VALUE_MAX];
+        const char *stored = colon + 2;
+        int stored_size = line_end - stored;
+        const char *value;
+        int value_size;
+        
+        copy_lower(name, line, colon - line);
+        
+        value = find_header(request, request_header_size, name, &value_size);
+        if(value == NULL) {
+            value = "";
+            value_size = 0;
+        }
+        
+        if(value_size != stored_size
+            || memcmp(value, stored, value_size) != 0) {
+            
+            return 0;
+        }
+        
+        line = line_end + 2;
+    }
+    
+    return 1;
+}
@@ -0,0 +1,105 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_CACHE_H_
+#define PROXY_CACHE_H_
+
+
+/*
+    Micro-cache for responses to GET requests, shared by all connection
+    handlers. The cache lives in a shared mapping split into CACHE_SHARDS
+    shards, each with its own lock and CACHE_SLOTS_PER_SHARD fixed size slots
+    of up to CACHE_OBJECT_MAX bytes of key and response. Slots are reclaimed
+    with the CLOCK algorithm.
+
+    Only complete 200 responses with a Content-Length and an explicit
+    freshness lifetime (Cache-Control s-maxage or max-age, or Expires) are
+    stored, along with the values of the request headers named by Vary.
+    Stale entries are served for the stale-while-revalidate period while one
+    handler refreshes them. On a miss, one handler fetches the response and
+    others asking for the same key wait for it for up to CACHE_FILL_WAIT_MS.
+    If the response turns out not to be cacheable, that is remembered for
+    CACHE_PASS_MS ("hit-for-pass"), during which requests for the key go
+    straight to the server without waiting for each other.
+*/
+
+#ifndef CACHE_ENABLED
+#define CACHE_ENABLED 0
+#endif
+
+#ifndef CACHE_SHARDS
+#define CACHE_SHARDS 16
+#endif
+
+#ifndef CACHE_SLOTS_PER_SHARD
+#define CACHE_SLOTS_PER_SHARD 64
+#endif
+
+#ifndef CACHE_OBJECT_MAX
+#define CACHE_OBJECT_MAX (64 * 1024)
+#endif
+
+#ifndef CACHE_FILL_WAIT_MS
+#define CACHE_FILL_WAIT_MS 2000
+#endif
+
+#ifndef CACHE_PASS_MS
+#define CACHE_PASS_MS 30000
+#endif
+
+#define CACHE_BYPASS    0   // fetch the response, don't store it
+#define CACHE_MISS      1   // fetch the response and store it
+#define CACHE_HIT       2   // fresh response returned
+#define CACHE_STALE     3   // stale response returned, refresh it
+
+
+void cache_init();
+
+int cache_lookup(
+    const char *request,
+    int request_size,
+    char **response,
+    int *response_size
+);
+
+int cache_response_size(
+    const char *response,
+    int response_size
+);
+
+void cache_store(
+    const char *request,
+    int request_size,
+    const char *response,
+    int response_size
+);
+
+void cache_abandon(
+    const char *request,
+    int request_size
+);
+
+void cache_pass(
+    const char *request,
+    int request_size
+);
+
+
+#endif // PROXY_CACHE_H_
@@ -0,0 +1,334 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <stdlib.h>
+#include <string.h>     // for memcpy()
+#include <unistd.h>     // for pipe() and write()
+#include <fcntl.h>      // for fcntl()
+#include <poll.h>       // for poll()
+#include <pthread.h>
+#include <semaphore.h>
+#include "proxy_inspect_pool.h"
+#include "proxy_overload.h"
+#include "proxy_timer.h"
+#include "reverse_proxy.h"
+
+/*********
+ * DEFINES
+ *********/
+
+#define INSPECT_QUEUE_MASK (INSPECT_QUEUE_SIZE - 1)
+
+/*********
+ * STRUCTS
+ *********/
+
+struct inspect_job {
+    char *data;
+    int data_size;
+    uint64_t enqueue_time;      // timer_now_us() when the job was submitted
+};
+
+/*
+    Cell of the bounded multi-producer multi-consumer queue described by
+    Dmitry Vyukov. The sequence number of a cell tells producers and consumers
+    whether the cell is free or holds a job for the current lap.
+*/
+struct queue_cell {
+    unsigned long sequence;
+    struct inspect_job job;
+};
+
+struct inspect_pool {
+    struct queue_cell cells[INSPECT_QUEUE_SIZE];
+    unsigned long enqueue_pos;
+    unsigned long dequeue_pos;
+    sem_t jobs;                 // number of jobs in the queue
+    int (*callback)(const char *, int);
+    int blocked;
+    int draining;               // wake the handler after every job
+    unsigned long submitted;    // only touched by the connection handler
+    unsigned long completed;
+    int verdict_pipe[2];
+};
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+static int enqueue(
+    struct inspect_pool *pool,
+    const struct inspect_job *job
+);
+
+static int dequeue(
+    struct inspect_pool *pool,
+    struct inspect_job *job
+);
+
+static void *inspect_worker(void *arg);
+
+static void wake_handler(struct inspect_pool *pool);
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+struct inspect_pool *inspect_pool_create(
+    int (*callback)(const char *, int),
+    int worker_count) {
+
+/*
+    Creates a pool of worker_count threads that run callback on submitted
+    data. Returns NULL on failure. Must be called after fork(), since threads
+    don't survive it.
+*/
+    
+    struct inspect_pool *pool = calloc(1, sizeof(*pool));
+    pthread_t thread;
+    int started = 0;
+    int i;
+    
+    if(pool == NULL) {
+        return NULL;
+    }
+    
+    for(i = 0; i < INSPECT_QUEUE_SIZE; i++) {
+        pool->cells[i].sequence = (unsigned long) i;
+    }
+    
+    pool->callback = callback;
+    
+    if(sem_init(&pool->jobs, 0, 0) < 0 || pipe(pool->verdict_pipe) < 0) {
+        free(pool);
+        return NULL;
+    }
+    
+    fcntl(pool->verdict_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(pool->verdict_pipe[1], F_SETFL, O_NONBLOCK);
+    
+    // the workers that did start keep the pool usable
+    for(i = 0; i < worker_count; i++) {
+        if(pthread_create(&thread, NULL, inspect_worker, pool) != 0) {
+            break;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    
+    if(started == 0) {
+        close(pool->verdict_pipe[0]);
+        close(pool->verdict_pipe[1]);
+        sem_destroy(&pool->jobs);
+        free(pool);
+        return NULL;
+    }
+    
+    return pool;
+}
+
+int inspect_pool_submit(
+    struct inspect_pool *pool,
+    const char *data,
+    int data_size) {
+
+/*
+    Queues a copy of data for inspection. Returns 1 on success, or 0 if the
+    queue is full, in which case the caller should inspect the data itself.
+*/
+    
+    struct inspect_job job;
+    
+    job.data = malloc(data_size);
+    if(job.data == NULL) {
+        return 0;
+    }
+    
+    memcpy(job.data, data, data_size);
+    job.data_size = data_size;
+    job.enqueue_time = timer_now_us();
+    
+    if(!enqueue(pool, &job)) {
+        free(job.data);
+        return 0;
+    }
+    
+    pool->submitted++;
+    sem_post(&pool->jobs);
+    return 1;
+}
+
+int inspect_pool_blocked(struct inspect_pool *pool) {
+    return __atomic_load_n(&pool->blocked, __ATOMIC_ACQUIRE);
+}
+
+int inspect_pool_verdict_fd(struct inspect_pool *pool) {
+    return pool->verdict_pipe[0];
+}
+
+int inspect_pool_drain(
+    struct inspect_pool *pool,
+    int timeout_ms) {
+
+/*
+    Waits up to timeout_ms for the workers to finish every job submitted so
+    far, so that a late PROXY_BLOCK can still be seen with
+    inspect_pool_blocked(). Returns the number of jobs still unfinished.
+*/
+    
+    uint64_t deadline = timer_now_ms() + timeout_ms;
+    struct pollfd poll_fd;
+    char wakeups[64];
+    
+    poll_fd.fd = pool->verdict_pipe[0];
+    poll_fd.events = POLLIN;
+    
+    __atomic_store_n(&pool->draining, 1, __ATOMIC_RELEASE);
+    
+    for(;;) {
+        unsigned long completed = __atomic_load_n(
+            &pool->completed,
+            __ATOMIC_ACQUIRE
+        );
+        uint64_t now = timer_now_ms();
+        
+        if(completed == pool->submitted || now >= deadline) {
+            return pool->submitted - completed;
+        }
+        
+        poll(&poll_fd, 1, deadline - now);
+        
+        while(read(pool->verdict_pipe[0], wakeups, sizeof(wakeups)) > 0) {
+            // drained the wakeups
+        }
+    }
+}
+
+static int enqueue(
+    struct inspect_pool *pool,
+    const struct inspect_job *job) {
+    
+    struct queue_cell *cell;
+    unsigned long pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+    
+    for(;;) {
+        cell = &pool->cells[pos & INSPECT_QUEUE_MASK];
+        long diff = (long) __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE)
+            - (long) pos;
+        
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&pool->enqueue_pos, &pos, pos + 1,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                
+                break;
+            }
+        }
+        else if(diff < 0) {
+            return 0;   // full
+        }
+        else {
+            pos = __atomic_load_n(&pool->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    cell->job = *job;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static int dequeue(
+    struct inspect_pool *pool,
+    struct inspect_job *job) {
+    
+    struct queue_cell *cell;
+    unsigned long pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+    
+    for(;;) {
+        cell = &pool->cells[pos & INSPECT_QUEUE_MASK];
+        long diff = (long) __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE)
+            - (long) (pos + 1);
+        
+        if(diff == 0) {
+            if(__atomic_compare_exchange_n(&pool->dequeue_pos, &pos, pos + 1,
+                1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                
+                break;
+            }
+        }
+        else if(diff < 0) {
+            return 0;   // empty
+        }
+        else {
+            pos = __atomic_load_n(&pool->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+    
+    *job = cell->job;
+    __atomic_store_n(
+        &cell->sequence,
+        pos + INSPECT_QUEUE_MASK + 1,
+        __ATOMIC_RELEASE
+    );
+    return 1;
+}
+
+static void *inspect_worker(void *arg) {
+    struct inspect_pool *pool = arg;
+    struct inspect_job job;
+    
+    for(;;) {
+        if(sem_wait(&pool->jobs) < 0) {
+            continue;   // interrupted by a signal
+        }
+        
+        if(!dequeue(pool, &job)) {
+            continue;
+        }
+        
+        int verdict = pool->callback(job.data, job.data_size);
+        free(job.data);
+        
+        overload_observe(timer_now_us() - job.enqueue_time);
+        
+        if(verdict == PROXY_BLOCK) {
+            __atomic_store_n(&pool->blocked, 1, __ATOMIC_RELEASE);
+        }
+        
+        __atomic_add_fetch(&pool->completed, 1, __ATOMIC_RELEASE);
+        
+        if(verdict == PROXY_BLOCK
+            || __atomic_load_n(&pool->draining, __ATOMIC_ACQUIRE)) {
+            
+            wake_handler(pool);
+        }
+    }
+    
+    return NULL;
+}
+
+static void wake_handler(struct inspect_pool *pool) {
+    if(write(pool->verdict_pipe[1], "", 1) < 0) {
+        // pipe already full of wakeups
+    }
+}
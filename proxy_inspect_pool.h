@@ -0,0 +1,72 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_INSPECT_POOL_H_
+#define PROXY_INSPECT_POOL_H_
+
+
+/*
+    Pool of inspection worker threads used for out-of-band inspection. Copies
+    of client data are handed to the workers through a bounded lock-free
+    queue, and each copy is run through the inspection callback. Once any
+    copy gets a verdict of PROXY_BLOCK, the pool is marked as blocked and its
+    verdict fd becomes readable. A pool lives until its process exits, which
+    should call inspect_pool_drain() first so that no verdict is lost.
+*/
+
+#ifndef INSPECT_POOL_WORKERS
+#define INSPECT_POOL_WORKERS 2
+#endif
+
+#ifndef INSPECT_QUEUE_SIZE
+#define INSPECT_QUEUE_SIZE 64  // must be a power of 2
+#endif
+
+// how long a connection handler waits for pending inspections before exiting
+#ifndef INSPECT_DRAIN_TIMEOUT_MS
+#define INSPECT_DRAIN_TIMEOUT_MS 1000
+#endif
+
+
+struct inspect_pool;
+
+
+struct inspect_pool *inspect_pool_create(
+    int (*callback)(const char *, int),
+    int worker_count
+);
+
+int inspect_pool_submit(
+    struct inspect_pool *pool,
+    const char *data,
+    int data_size
+);
+
+int inspect_pool_blocked(struct inspect_pool *pool);
+
+int inspect_pool_verdict_fd(struct inspect_pool *pool);
+
+int inspect_pool_drain(
+    struct inspect_pool *pool,
+    int timeout_ms
+);
+
+
+#endif // PROXY_INSPECT_POOL_H_
@@ -0,0 +1,199 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>   // for mmap()
+#include <unistd.h>
+#include "proxy_memory.h"
+#include "proxy_stats.h"
+
+/*********
+ * DEFINES
+ *********/
+
+#define MEMORY_PRESSURE_START \
+    ((unsigned long) MEMORY_BUDGET / 100 * MEMORY_PRESSURE_PERCENT)
+
+/*********
+ * STRUCTS
+ *********/
+
+struct memory_slot {
+    int pid;                // owner, 0 if the slot is free
+    unsigned long bytes;    // charged by the owner
+};
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+// shared by all processes, see memory_init()
+static struct memory_slot *memory_slots = NULL;
+
+// slot of this process, if it is a connection handler that got one
+static struct memory_slot *memory_slot = NULL;
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+void memory_init() {
+
+/*
+    The bytes in use are kept in the shared proxy_stats mapping so that all
+    connection handlers draw from the same budget. proxy_stats_init() must
+    have been called first, and this must be called before any child process
+    is forked.
+*/
+    
+    proxy_stats->memory_in_use = 0;
+    
+    memory_slots = mmap(
+        NULL,
+        sizeof(*memory_slots) * MEMORY_SLOTS,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    
+    if(memory_slots == MAP_FAILED) {
+        perror("mmap() failed");
+        exit(1);
+    }
+}
+
+void memory_attach() {
+
+/*
+    Called by a connection handler right after fork(), before it charges any
+    memory. Claims a free slot, starting at a position derived from the pid.
+*/
+    
+    int pid = getpid();
+    int i;
+    
+    for(i = 0; i < MEMORY_SLOTS; i++) {
+        struct memory_slot *slot = &memory_slots[(pid + i) % MEMORY_SLOTS];
+        
+        if(__sync_bool_compare_and_swap(&slot->pid, 0, pid)) {
+            slot->bytes = 0;
+            memory_slot = slot;
+            return;
+        }
+    }
+}
+
+void memory_reclaim(int pid) {
+
+/*
+    Called by the accepting process for each connection handler it reaps.
+    Releases whatever the handler still had charged, which is nothing unless
+    it was killed, and frees its slot.
+*/
+    
+    int i;
+    
+    for(i = 0; i < MEMORY_SLOTS; i++) {
+        struct memory_slot *slot = &memory_slots[(pid + i) % MEMORY_SLOTS];
+        
+        if(slot->pid == pid) {
+            if(slot->bytes > 0) {
+                __sync_fetch_and_sub(&proxy_stats->memory_in_use, slot->bytes);
+                __sync_fetch_and_add(
+                    &proxy_stats->memory_reclaimed,
+                    slot->bytes
+                );
+            }
+            
+            slot->bytes = 0;
+            __sync_lock_release(&slot->pid);
+            return;
+        }
+    }
+}
+
+int memory_reserve(
+    size_t bytes,
+    int force) {
+
+/*
+    Charges bytes against the budget. Returns 1 on success, or 0 if that would
+    exceed the budget, unless force is set, in which case the charge is always
+    made. Forced charges are meant for the minimum buffers of a connection.
+*/
+    
+    unsigned long in_use = proxy_stats->memory_in_use;
+    
+    for(;;) {
+        if(!force && in_use + bytes > MEMORY_BUDGET) {
+            PROXY_STATS_INC(memory_denials);
+            return 0;
+        }
+        
+        unsigned long seen = __sync_val_compare_and_swap(
+            &proxy_stats->memory_in_use,
+            in_use,
+            in_use + bytes
+        );
+        
+        if(seen == in_use) {
+            if(memory_slot != NULL) {
+                memory_slot->bytes += bytes;
+            }
+            return 1;
+        }
+        
+        in_use = seen;
+    }
+}
+
+void memory_release(size_t bytes) {
+    __sync_fetch_and_sub(&proxy_stats->memory_in_use, bytes);
+    
+    if(memory_slot != NULL) {
+        memory_slot->bytes -= bytes;
+    }
+}
+
+size_t memory_buffer_cap() {
+
+    // current maximum size of a single connection buffer
+    
+    unsigned long in_use = proxy_stats->memory_in_use;
+    unsigned long pressure_range = MEMORY_BUDGET - MEMORY_PRESSURE_START;
+    unsigned long cap_range = BUFFER_MAX_SIZE - BUFFER_MIN_SIZE;
+    
+    if(in_use <= MEMORY_PRESSURE_START) {
+        return BUFFER_MAX_SIZE;
+    }
+    
+    if(in_use >= MEMORY_BUDGET) {
+        return BUFFER_MIN_SIZE;
+    }
+    
+    return BUFFER_MAX_SIZE - (size_t) ((double) cap_range
+        * (in_use - MEMORY_PRESSURE_START) / pressure_range);
+}
@@ -0,0 +1,78 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_MEMORY_H_
+#define PROXY_MEMORY_H_
+
+#include <stddef.h>
+
+
+/*
+    Process-wide accounting of connection buffer memory. MEMORY_BUDGET bytes
+    are shared by all connection handlers. Every connection starts with
+    BUFFER_MIN_SIZE bytes per direction and may grow its buffers up to the
+    current per-connection cap, which is BUFFER_MAX_SIZE while less than
+    MEMORY_PRESSURE_PERCENT of the budget is in use and then shrinks linearly
+    towards BUFFER_MIN_SIZE as the budget fills up.
+
+    Each connection handler charges its memory to a slot of its own as well,
+    so that the accepting process can give back what a handler still held
+    when it died, see memory_reclaim(). A handler that finds all
+    MEMORY_SLOTS slots taken is only accounted for in the total.
+*/
+
+#ifndef MEMORY_BUDGET
+#define MEMORY_BUDGET (256 * 1024 * 1024)
+#endif
+
+#ifndef MEMORY_PRESSURE_PERCENT
+#define MEMORY_PRESSURE_PERCENT 50
+#endif
+
+#ifndef BUFFER_MIN_SIZE
+#define BUFFER_MIN_SIZE (16 * 1024)
+#endif
+
+#ifndef BUFFER_MAX_SIZE
+#define BUFFER_MAX_SIZE 1000000
+#endif
+
+#ifndef MEMORY_SLOTS
+#define MEMORY_SLOTS 4096
+#endif
+
+
+void memory_init();
+
+void memory_attach();
+
+void memory_reclaim(int pid);
+
+int memory_reserve(
+    size_t bytes,
+    int force
+);
+
+void memory_release(size_t bytes);
+
+size_t memory_buffer_cap();
+
+
+#endif // PROXY_MEMORY_H_
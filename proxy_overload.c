@@ -0,0 +1,90 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <syslog.h>
+#include "proxy_overload.h"
+#include "proxy_stats.h"
+#include "proxy_timer.h"
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+void overload_observe(uint64_t delay_us) {
+
+/*
+    Adds an inspection delay sample to the shared moving average and updates
+    the overload state. Safe to call from any process or thread.
+*/
+    
+    unsigned long old_delay;
+    unsigned long new_delay;
+    
+    do {
+        old_delay = proxy_stats->overload_delay_us;
+        new_delay = old_delay
+            + ((long) delay_us - (long) old_delay) / OVERLOAD_EWMA_WEIGHT;
+    } while(!__sync_bool_compare_and_swap(
+        &proxy_stats->overload_delay_us,
+        old_delay,
+        new_delay
+    ));
+    
+    proxy_stats->overload_last_sample_ms = timer_now_ms();
+    
+    if(new_delay > OVERLOAD_HIGH_US) {
+        if(__sync_bool_compare_and_swap(&proxy_stats->overloaded, 0, 1)) {
+            PROXY_STATS_INC(overload_episodes);
+            syslog(
+                LOG_WARNING,
+                "inspection overloaded, delay %lu us\n",
+                new_delay
+            );
+        }
+    }
+    else if(new_delay < OVERLOAD_LOW_US) {
+        if(__sync_bool_compare_and_swap(&proxy_stats->overloaded, 1, 0)) {
+            syslog(LOG_INFO, "inspection no longer overloaded\n");
+        }
+    }
+}
+
+int overload_active() {
+    if(!proxy_stats->overloaded) {
+        return 0;
+    }
+    
+    // shedding load can starve the average of new samples, so let it decay
+    if(timer_now_ms() - proxy_stats->overload_last_sample_ms
+        > OVERLOAD_DECAY_MS) {
+        
+        proxy_stats->overload_delay_us = 0;
+        if(__sync_bool_compare_and_swap(&proxy_stats->overloaded, 1, 0)) {
+            syslog(LOG_INFO, "inspection no longer overloaded\n");
+        }
+        return 0;
+    }
+    
+    return 1;
+}
@@ -0,0 +1,74 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_OVERLOAD_H_
+#define PROXY_OVERLOAD_H_
+
+#include <stdint.h>
+
+
+/*
+    Overload control for the inspection stage. Every inspection reports how
+    long the data waited for its verdict, counting both time spent in the
+    inspection queue and inspection itself. The reports of all workers feed a
+    shared moving average. The proxy is overloaded from the moment that
+    average exceeds OVERLOAD_HIGH_US until it falls below OVERLOAD_LOW_US, or
+    until no inspection has been reported for OVERLOAD_DECAY_MS.
+
+    While overloaded, OVERLOAD_POLICY decides what gives:
+    OVERLOAD_FAIL_OPEN              expensive rules are replaced by cheap
+                                    approximations
+    OVERLOAD_FAIL_CLOSED            requests are answered with 503 uninspected
+    OVERLOAD_PRIORITIZE_ESTABLISHED new connections are answered with 503 so
+                                    that established ones keep their capacity
+*/
+
+#define OVERLOAD_FAIL_OPEN              0
+#define OVERLOAD_FAIL_CLOSED            1
+#define OVERLOAD_PRIORITIZE_ESTABLISHED 2
+
+#ifndef OVERLOAD_POLICY
+#define OVERLOAD_POLICY OVERLOAD_FAIL_CLOSED
+#endif
+
+#ifndef OVERLOAD_HIGH_US
+#define OVERLOAD_HIGH_US 50000
+#endif
+
+#ifndef OVERLOAD_LOW_US
+#define OVERLOAD_LOW_US 10000
+#endif
+
+#ifndef OVERLOAD_DECAY_MS
+#define OVERLOAD_DECAY_MS 1000
+#endif
+
+// a new sample makes up 1/OVERLOAD_EWMA_WEIGHT of the moving average
+#ifndef OVERLOAD_EWMA_WEIGHT
+#define OVERLOAD_EWMA_WEIGHT 8
+#endif
+
+
+void overload_observe(uint64_t delay_us);
+
+int overload_active();
+
+
+#endif // PROXY_OVERLOAD_H_
@@ -0,0 +1,147 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>   // for mmap()
+#include <syslog.h>
+#include "proxy_stats.h"
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+// names of the inspection rules, see proxy_stats_name_rules()
+static const char **rule_names = NULL;
+static int rule_name_count = 0;
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+struct proxy_stats *proxy_stats = NULL;
+
+void proxy_stats_init() {
+
+    // must be called before any child process is forked
+    
+    proxy_stats = mmap(
+        NULL,
+        sizeof(*proxy_stats),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    
+    if(proxy_stats == MAP_FAILED) {
+        perror("mmap() failed");
+        exit(1);
+    }
+}
+
+void proxy_stats_name_rules(
+    const char **names,
+    int count) {
+
+/*
+    Gives the names under which the budget hits of the first count rules are
+    logged, so that they can be told apart. Rules without a name are logged
+    by number.
+*/
+    
+    rule_names = names;
+    rule_name_count = count;
+}
+
+void proxy_stats_log() {
+    int i;
+    
+    syslog(
+        LOG_INFO,
+        "stats: accepted=%lu timeouts: header=%lu rate=%lu idle=%lu "
+        "lifetime=%lu drain=%lu memory: in_use=%lu denials=%lu reclaimed=%lu "
+        "headers_too_large=%lu inspection: inline=%lu inline_us=%lu "
+        "async=%lu async_queue_full=%lu async_resets=%lu "
+        "async_late_blocks=%lu async_unfinished=%lu overload: "
+        "delay_us=%lu active=%lu episodes=%lu skipped_rules=%lu "
+        "rejected=%lu shed_new=%lu cache: hits=%lu stale_hits=%lu "
+        "coalesced=%lu misses=%lu bypasses=%lu passes=%lu stores=%lu "
+        "evictions=%lu\n",
+        proxy_stats->connections_accepted,
+        proxy_stats->timeouts_header,
+        proxy_stats->timeouts_rate,
+        proxy_stats->timeouts_idle,
+        proxy_stats->timeouts_lifetime,
+        proxy_stats->timeouts_drain,
+        proxy_stats->memory_in_use,
+        proxy_stats->memory_denials,
+        proxy_stats->memory_reclaimed,
+        proxy_stats->headers_too_large,
+        proxy_stats->inline_inspections,
+        proxy_stats->inline_inspection_us,
+        proxy_stats->async_inspections,
+        proxy_stats->async_queue_full,
+        proxy_stats->async_resets,
+        proxy_stats->async_late_blocks,
+        proxy_stats->async_unfinished,
+        proxy_stats->overload_delay_us,
+        proxy_stats->overloaded,
+        proxy_stats->overload_episodes,
+        proxy_stats->overload_skipped_rules,
+        proxy_stats->overload_rejected,
+        proxy_stats->overload_shed_new,
+        proxy_stats->cache_hits,
+        proxy_stats->cache_stale_hits,
+        proxy_stats->cache_coalesced,
+        proxy_stats->cache_misses,
+        proxy_stats->cache_bypasses,
+        proxy_stats->cache_passes,
+        proxy_stats->cache_stores,
+        proxy_stats->cache_evictions
+    );
+    
+    for(i = 0; i < PROXY_STATS_MAX_RULES; i++) {
+        if(proxy_stats->rule_budget_hits[i] == 0) {
+            continue;
+        }
+        
+        if(i < rule_name_count) {
+            syslog(
+                LOG_INFO,
+                "stats: rule %s budget_hits=%lu\n",
+                rule_names[i],
+                proxy_stats->rule_budget_hits[i]
+            );
+        }
+        else {
+            syslog(
+                LOG_INFO,
+                "stats: rule %d budget_hits=%lu\n",
+                i,
+                proxy_stats->rule_budget_hits[i]
+            );
+        }
+    }
+}
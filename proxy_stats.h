@@ -0,0 +1,89 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_STATS_H_
+#define PROXY_STATS_H_
+
+
+/*
+    Counters shared by the accepting process and all of its connection
+    handling children. The structure lives in an anonymous shared mapping
+    created before the first fork(), so increments made by a child are visible
+    to the parent.
+*/
+
+// number of inspection rules whose evaluation budget hits are counted
+#define PROXY_STATS_MAX_RULES 8
+
+struct proxy_stats {
+    unsigned long connections_accepted;
+    unsigned long timeouts_header;
+    unsigned long timeouts_rate;
+    unsigned long timeouts_idle;
+    unsigned long timeouts_lifetime;
+    unsigned long timeouts_drain;
+    unsigned long memory_in_use;        // bytes, see proxy_memory.h
+    unsigned long memory_denials;
+    unsigned long memory_reclaimed;     // bytes left behind by dead handlers
+    unsigned long headers_too_large;
+    unsigned long inline_inspections;
+    unsigned long inline_inspection_us; // total time clients waited for them
+    unsigned long async_inspections;
+    unsigned long async_queue_full;
+    unsigned long async_resets;
+    unsigned long async_late_blocks;    // blocked after the connection closed
+    unsigned long async_unfinished;     // abandoned when the handler exited
+    unsigned long overload_delay_us;    // see proxy_overload.h
+    unsigned long overload_last_sample_ms;
+    unsigned long overloaded;
+    unsigned long overload_episodes;
+    unsigned long overload_skipped_rules;
+    unsigned long overload_rejected;
+    unsigned long overload_shed_new;
+    unsigned long cache_hits;
+    unsigned long cache_stale_hits;
+    unsigned long cache_coalesced;
+    unsigned long cache_misses;
+    unsigned long cache_bypasses;
+    unsigned long cache_passes;         // bypassed as known not cacheable
+    unsigned long cache_stores;
+    unsigned long cache_evictions;
+    unsigned long rule_budget_hits[PROXY_STATS_MAX_RULES];
+};
+
+
+extern struct proxy_stats *proxy_stats;
+
+
+#define PROXY_STATS_INC(field) \
+    __sync_fetch_and_add(&proxy_stats->field, 1)
+
+
+void proxy_stats_init();
+
+void proxy_stats_name_rules(
+    const char **names,
+    int count
+);
+
+void proxy_stats_log();
+
+
+#endif // PROXY_STATS_H_
@@ -0,0 +1,328 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <time.h>       // for clock_gettime()
+#include <stddef.h>
+#include "proxy_timer.h"
+
+/*********
+ * DEFINES
+ *********/
+
+#define TIMER_ROOT_MASK (TIMER_ROOT_SIZE - 1)
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+
+// largest distance in ticks that fits in the wheel
+#define TIMER_MAX_TICKS \
+    ((1ULL << (TIMER_ROOT_BITS + TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1)
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+static void list_init(struct proxy_timer *head);
+
+static void list_append(
+    struct proxy_timer *head,
+    struct proxy_timer *timer
+);
+
+static void list_splice(
+    struct proxy_timer *from,
+    struct proxy_timer *to
+);
+
+static void internal_add(
+    struct timer_wheel *wheel,
+    struct proxy_timer *timer
+);
+
+static int cascade(
+    struct timer_wheel *wheel,
+    int level,
+    int index
+);
+
+static int level_index(
+    uint64_t tick,
+    int level
+);
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+uint64_t timer_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+uint64_t timer_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void timer_wheel_init(
+    struct timer_wheel *wheel,
+    uint64_t now_ms) {
+    
+    int i;
+    int j;
+    
+    wheel->current_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    
+    for(i = 0; i < TIMER_ROOT_SIZE; i++) {
+        list_init(&wheel->root[i]);
+    }
+    
+    for(i = 0; i < TIMER_LEVELS; i++) {
+        for(j = 0; j < TIMER_LEVEL_SIZE; j++) {
+            list_init(&wheel->levels[i][j]);
+        }
+    }
+}
+
+void timer_init(
+    struct proxy_timer *timer,
+    void (*callback)(void *),
+    void *arg) {
+    
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void timer_add(
+    struct timer_wheel *wheel,
+    struct proxy_timer *timer,
+    uint64_t expires_ms) {
+
+/*
+    Arms timer to fire at expires_ms (a timer_now_ms() timestamp). A timer that
+    is already pending is re-armed. Expiry is rounded up to the next tick so
+    that a timer never fires early.
+*/
+    
+    timer_del(timer);
+    timer->expires =
+        (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+    internal_add(wheel, timer);
+}
+
+void timer_del(struct proxy_timer *timer) {
+    if(!timer_pending(timer)) {
+        return;
+    }
+    
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+int timer_pending(const struct proxy_timer *timer) {
+    return timer->next != NULL;
+}
+
+void timer_wheel_advance(
+    struct timer_wheel *wheel,
+    uint64_t now_ms) {
+
+/*
+    Runs the callbacks of all timers that have expired by now_ms. Callbacks may
+    add or delete timers, including the one that is firing.
+*/
+    
+    uint64_t now_tick = now_ms / TIMER_WHEEL_TICK_MS;
+    struct proxy_timer expired;
+    
+    while(wheel->current_tick <= now_tick) {
+        int index = wheel->current_tick & TIMER_ROOT_MASK;
+        
+        // when the root level wraps around, pull the next slot of each upper
+        // level down, stopping at the first level that did not wrap
+        if(index == 0) {
+            int level = 0;
+            while(level < TIMER_LEVELS
+                && cascade(
+                    wheel,
+                    level,
+                    level_index(wheel->current_tick, level)
+                ) == 0) {
+                
+                level++;
+            }
+        }
+        
+        wheel->current_tick++;
+        
+        // detach the slot first so callbacks can safely re-arm timers
+        list_init(&expired);
+        list_splice(&wheel->root[index], &expired);
+        
+        while(expired.next != &expired) {
+            struct proxy_timer *timer = expired.next;
+            timer_del(timer);
+            timer->callback(timer->arg);
+        }
+    }
+}
+
+int timer_wheel_timeout(
+    const struct timer_wheel *wheel,
+    uint64_t now_ms) {
+
+/*
+    Returns how many milliseconds may pass from now_ms before
+    timer_wheel_advance() has to be called, for use as a poll() timeout. That
+    is until the first non-empty slot of the first level, or until the first
+    level wraps around and upper level timers have to be cascaded, whichever
+    comes first.
+*/
+    
+    uint64_t tick = wheel->current_tick;
+    uint64_t due_ms;
+    
+    while((tick & TIMER_ROOT_MASK) != 0
+        && wheel->root[tick & TIMER_ROOT_MASK].next
+            == &wheel->root[tick & TIMER_ROOT_MASK]) {
+        
+        tick++;
+    }
+    
+    due_ms = tick * TIMER_WHEEL_TICK_MS;
+    
+    if(due_ms <= now_ms) {
+        return 0;
+    }
+    
+    return due_ms - now_ms;
+}
+
+static void list_init(struct proxy_timer *head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void list_append(
+    struct proxy_timer *head,
+    struct proxy_timer *timer) {
+    
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_splice(
+    struct proxy_timer *from,
+    struct proxy_timer *to) {
+
+    // moves all timers from list "from" to the end of list "to"
+    
+    if(from->next == from) {
+        return;
+    }
+    
+    from->next->prev = to->prev;
+    to->prev->next = from->next;
+    from->prev->next = to;
+    to->prev = from->prev;
+    list_init(from);
+}
+
+static void internal_add(
+    struct timer_wheel *wheel,
+    struct proxy_timer *timer) {
+    
+    uint64_t expires = timer->expires;
+    uint64_t distance;
+    struct proxy_timer *slot;
+    
+    // timers that are already due go in the slot that is processed next
+    if(expires < wheel->current_tick) {
+        expires = wheel->current_tick;
+    }
+    
+    distance = expires - wheel->current_tick;
+    
+    // timers beyond the range of the wheel are parked in the farthest slot and
+    // re-filed with their real expiry each time they are cascaded
+    if(distance > TIMER_MAX_TICKS) {
+        distance = TIMER_MAX_TICKS;
+        expires = wheel->current_tick + distance;
+    }
+    
+    if(distance < TIMER_ROOT_SIZE) {
+        slot = &wheel->root[expires & TIMER_ROOT_MASK];
+    }
+    else {
+        int level = 0;
+        while(distance >= 1ULL << (TIMER_ROOT_BITS
+            + (level + 1) * TIMER_LEVEL_BITS)) {
+            
+            level++;
+        }
+        slot = &wheel->levels[level][level_index(expires, level)];
+    }
+    
+    list_append(slot, timer);
+}
+
+static int cascade(
+    struct timer_wheel *wheel,
+    int level,
+    int index) {
+
+/*
+    Re-files every timer in the given upper level slot into the levels below
+    it. Returns index, so that a return value of 0 means this level wrapped
+    around as well and the next level up must be cascaded too.
+*/
+    
+    struct proxy_timer pending;
+    
+    list_init(&pending);
+    list_splice(&wheel->levels[level][index], &pending);
+    
+    while(pending.next != &pending) {
+        struct proxy_timer *timer = pending.next;
+        timer_del(timer);
+        internal_add(wheel, timer);
+    }
+    
+    return index;
+}
+
+static int level_index(
+    uint64_t tick,
+    int level) {
+    
+    return (tick >> (TIMER_ROOT_BITS + level * TIMER_LEVEL_BITS))
+        & TIMER_LEVEL_MASK;
+}
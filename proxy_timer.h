@@ -0,0 +1,97 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_TIMER_H_
+#define PROXY_TIMER_H_
+
+#include <stdint.h>
+
+
+/*
+    Hierarchical timing wheel, in the style of the classic Linux kernel timer
+    base. The first level has 256 slots of one tick each, and each of the three
+    upper levels has 64 slots, each slot covering a full revolution of the level
+    below it. Adding and deleting a timer is O(1); timers in upper levels are
+    cascaded down one level each time the level below wraps around.
+*/
+
+#ifndef TIMER_WHEEL_TICK_MS
+#define TIMER_WHEEL_TICK_MS 10
+#endif
+
+#define TIMER_ROOT_BITS 8
+#define TIMER_LEVEL_BITS 6
+#define TIMER_ROOT_SIZE (1 << TIMER_ROOT_BITS)
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 3
+
+
+struct proxy_timer {
+    struct proxy_timer *next;
+    struct proxy_timer *prev;
+    uint64_t expires;           // expiry time in ticks
+    void (*callback)(void *);
+    void *arg;
+};
+
+struct timer_wheel {
+    uint64_t current_tick;      // next tick to be processed
+    struct proxy_timer root[TIMER_ROOT_SIZE];
+    struct proxy_timer levels[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+};
+
+
+uint64_t timer_now_ms();
+
+uint64_t timer_now_us();
+
+void timer_wheel_init(
+    struct timer_wheel *wheel,
+    uint64_t now_ms
+);
+
+void timer_init(
+    struct proxy_timer *timer,
+    void (*callback)(void *),
+    void *arg
+);
+
+void timer_add(
+    struct timer_wheel *wheel,
+    struct proxy_timer *timer,
+    uint64_t expires_ms
+);
+
+void timer_del(struct proxy_timer *timer);
+
+int timer_pending(const struct proxy_timer *timer);
+
+void timer_wheel_advance(
+    struct timer_wheel *wheel,
+    uint64_t now_ms
+);
+
+int timer_wheel_timeout(
+    const struct timer_wheel *wheel,
+    uint64_t now_ms
+);
+
+
+#endif // PROXY_TIMER_H_
@@ -0,0 +1,410 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>      // for open()
+#include <sys/mman.h>   // for mmap()
+#include <time.h>
+#include <unistd.h>
+#include "proxy_trace.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>  // for __rdtsc()
+#endif
+
+/*********
+ * DEFINES
+ *********/
+
+#define TRACE_CALIBRATION_US 10000
+
+/*********
+ * STRUCTS
+ *********/
+
+struct trace_event {
+    unsigned long sequence;     // position in the ring + 1, written last
+    uint64_t tsc;
+    uint64_t duration;          // in TSC ticks, for complete events
+    unsigned long connection;
+    int pid;
+    int stage;
+    char phase;                 // 'X' for a complete event, 'i' for instant
+};
+
+struct trace_ring {
+    unsigned long head;
+    struct trace_event events[TRACE_RING_SIZE];
+};
+
+struct trace_shared {
+    unsigned long connections;
+    unsigned long sampled;      // connections traced so far
+    uint64_t tsc_base;
+    double tsc_per_us;
+    int pid;
+    struct trace_ring rings[TRACE_RINGS];
+};
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+static struct trace_shared *trace_shared = NULL;
+
+static const char *trace_stage_names[TRACE_STAGES] = {
+    "accept",
+    "fork",
+    "connect",
+    "buffer",
+    "inspect",
+    "backend",
+    "close"
+};
+
+static inline uint64_t read_tsc();
+
+static uint64_t clock_ns();
+
+static void append_event(
+    struct proxy_trace *trace,
+    int stage,
+    char phase,
+    uint64_t tsc,
+    uint64_t duration
+);
+
+static int compare_events(
+    const void *a,
+    const void *b
+);
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+void trace_init() {
+
+/*
+    Maps the rings and calibrates the TSC against CLOCK_MONOTONIC. Must be
+    called before any child process is forked. Does nothing when tracing is
+    compiled out.
+*/
+    
+    uint64_t tsc_start;
+    uint64_t ns_start;
+    
+    if(TRACE_SAMPLE_RATE == 0) {
+        return;
+    }
+    
+    trace_shared = mmap(
+        NULL,
+        sizeof(*trace_shared),
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0
+    );
+    
+    if(trace_shared == MAP_FAILED) {
+        perror("mmap() failed");
+        exit(1);
+    }
+    
+    ns_start = clock_ns();
+    tsc_start = read_tsc();
+    usleep(TRACE_CALIBRATION_US);
+    trace_shared->tsc_per_us = (double) (read_tsc() - tsc_start)
+        / ((clock_ns() - ns_start) / 1000.0);
+    trace_shared->tsc_base = tsc_start;
+    trace_shared->pid = getpid();
+}
+
+void trace_start(struct proxy_trace *trace) {
+
+/*
+    Called by the accepting process for every new connection, decides whether
+    the connection is traced.
+*/
+    
+    trace->active = 0;
+    trace->open_stages = 0;
+    
+#if TRACE_SAMPLE_RATE > 0
+    if(trace_shared == NULL) {
+        return;
+    }
+    
+    trace->connection = __sync_add_and_fetch(&trace_shared->connections, 1);
+    trace->active = trace->connection % TRACE_SAMPLE_RATE == 0;
+    
+    // rings are handed out in turn to the traced connections only
+    if(trace->active) {
+        trace->pid = getpid();
+        trace->ring = __sync_fetch_and_add(&trace_shared->sampled, 1)
+            % TRACE_RINGS;
+    }
+#endif
+}
+
+void trace_child(struct proxy_trace *trace) {
+
+    // called by the connection handler of a traced connection after fork()
+    
+    trace->pid = getpid();
+    trace_end(trace, TRACE_FORK);
+}
+
+void trace_begin(
+    struct proxy_trace *trace,
+    int stage) {
+
+/*
+    Opens a span of stage, unless one is open already, so that callers don't
+    have to track that. Nothing is recorded until the span is closed.
+*/
+    
+    unsigned bit = 1u << stage;
+    
+    if(trace->open_stages & bit) {
+        return;
+    }
+    
+    trace->open_stages |= bit;
+    trace->begin[stage] = read_tsc();
+}
+
+void trace_end(
+    struct proxy_trace *trace,
+    int stage) {
+
+/*
+    Closes the open span of stage, if any, and records it as a complete
+    event. Spans of different stages may overlap without nesting, which
+    begin and end events on the same track can't express.
+*/
+    
+    unsigned bit = 1u << stage;
+    uint64_t now;
+    
+    if(!(trace->open_stages & bit)) {
+        return;
+    }
+    
+    trace->open_stages &= ~bit;
+    now = read_tsc();
+    append_event(
+        trace,
+        stage,
+        'X',
+        trace->begin[stage],
+        now - trace->begin[stage]
+    );
+}
+
+void trace_instant(
+    struct proxy_trace *trace,
+    int stage) {
+    
+    append_event(trace, stage, 'i', read_tsc(), 0);
+}
+
+void trace_finish(struct proxy_trace *trace) {
+
+/*
+    Closes the spans left open and records the end of the connection.
+*/
+    
+    int stage;
+    
+    for(stage = 0; stage < TRACE_STAGES; stage++) {
+        TRACE_END(trace, stage);
+    }
+    
+    TRACE_INSTANT(trace, TRACE_CLOSE);
+}
+
+int trace_dump(const char *path) {
+
+/*
+    Writes the events currently in the rings to path as a Chrome trace event
+    JSON file, ordered by time. Called by the accepting process while the
+    handlers keep recording, so events that are overwritten while they are
+    copied are dropped. Returns the number of events written, or -1 on error.
+*/
+    
+    struct trace_event *events;
+    FILE *file;
+    int fd;
+    int count = 0;
+    int i;
+    int j;
+    
+    if(TRACE_SAMPLE_RATE == 0 || trace_shared == NULL) {
+        return 0;
+    }
+    
+    events = malloc(sizeof(*events) * TRACE_RINGS * TRACE_RING_SIZE);
+    if(events == NULL) {
+        return -1;
+    }
+    
+    for(i = 0; i < TRACE_RINGS; i++) {
+        for(j = 0; j < TRACE_RING_SIZE; j++) {
+            struct trace_event *event = &trace_shared->rings[i].events[j];
+            unsigned long sequence = __atomic_load_n(
+                &event->sequence,
+                __ATOMIC_ACQUIRE
+            );
+            
+            if(sequence == 0) {
+                continue;
+            }
+            
+            events[count] = *event;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            
+            if(__atomic_load_n(&event->sequence, __ATOMIC_RELAXED)
+                == sequence) {
+                
+                events[count].sequence = sequence;
+                count++;
+            }
+        }
+    }
+    
+    qsort(events, count, sizeof(*events), compare_events);
+    
+    // never follow a symlink someone else may have put in place of the file
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    file = fd < 0 ? NULL : fdopen(fd, "w");
+    if(file == NULL) {
+        if(fd >= 0) {
+            close(fd);
+        }
+        free(events);
+        return -1;
+    }
+    
+    fprintf(file, "{\"traceEvents\":[\n");
+    
+    for(i = 0; i < count; i++) {
+        fprintf(
+            file,
+            "{\"name\":\"%s\",\"ph\":\"%c\",%s\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":%d,\"tid\":%lu,\"args\":{\"pid\":%d}}%s\n",
+            trace_stage_names[events[i].stage],
+            events[i].phase,
+            events[i].phase == 'i' ? "\"s\":\"t\"," : "",
+            (int64_t) (events[i].tsc - trace_shared->tsc_base)
+                / trace_shared->tsc_per_us,
+            events[i].duration / trace_shared->tsc_per_us,
+            trace_shared->pid,
+            events[i].connection,
+            events[i].pid,
+            i + 1 < count ? "," : ""
+        );
+    }
+    
+    fprintf(file, "],\"displayTimeUnit\":\"ms\"}\n");
+    
+    free(events);
+    
+    if(fclose(file) != 0) {
+        return -1;
+    }
+    
+    return count;
+}
+
+static void append_event(
+    struct proxy_trace *trace,
+    int stage,
+    char phase,
+    uint64_t tsc,
+    uint64_t duration) {
+
+/*
+    Appends an event to the ring of the connection. Writers claim a slot with
+    an atomic increment of the ring head, so the accepting process and the
+    handler, or connections sharing a ring once there are more than
+    TRACE_RINGS of them, can write without locking. The sequence number of a
+    slot is stored last so that trace_dump() can skip slots that are being
+    written.
+*/
+    
+    struct trace_ring *ring = &trace_shared->rings[trace->ring];
+    unsigned long position = __sync_fetch_and_add(&ring->head, 1);
+    struct trace_event *event =
+        &ring->events[position & (TRACE_RING_SIZE - 1)];
+    
+    __atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->tsc = tsc;
+    event->duration = duration;
+    event->connection = trace->connection;
+    event->pid = trace->pid;
+    event->stage = stage;
+    event->phase = phase;
+    __atomic_store_n(&event->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint64_t read_tsc() {
+
+/*
+    The TSC is invariant on the CPUs this is expected to run on, so its
+    readings are comparable across processes. Elsewhere the monotonic clock
+    stands in for it.
+*/
+    
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return clock_ns();
+#endif
+}
+
+static uint64_t clock_ns() {
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int compare_events(
+    const void *a,
+    const void *b) {
+    
+    const struct trace_event *event_a = a;
+    const struct trace_event *event_b = b;
+    
+    if(event_a->tsc != event_b->tsc) {
+        return event_a->tsc < event_b->tsc ? -1 : 1;
+    }
+    
+    return event_a->sequence < event_b->sequence ? -1
+        : event_a->sequence > event_b->sequence;
+}
@@ -0,0 +1,137 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_TRACE_H_
+#define PROXY_TRACE_H_
+
+#include <stdint.h>
+
+
+/*
+    Sampled per-connection stage tracing. One in TRACE_SAMPLE_RATE
+    connections is traced, and 0 compiles tracing out. Events carry a TSC
+    timestamp and are written to lock-free rings in a shared mapping, which
+    traced connections take in turn, so that the accepting process can dump
+    them on SIGUSR2 to TRACE_DUMP_PATH in Chrome trace event format (load it
+    in chrome://tracing or Perfetto). Each connection gets its own track, and
+    every stage is a complete event, since stages may overlap.
+*/
+
+#ifndef TRACE_SAMPLE_RATE
+#define TRACE_SAMPLE_RATE 0
+#endif
+
+#ifndef TRACE_RINGS
+#define TRACE_RINGS 64
+#endif
+
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE 1024   // must be a power of 2
+#endif
+
+// written by root, so it must not be in a directory others can write to
+#ifndef TRACE_DUMP_PATH
+#define TRACE_DUMP_PATH "/var/run/apache_ips_trace.json"
+#endif
+
+// stages of the proxy pipeline
+#define TRACE_ACCEPT    0   // connection accepted
+#define TRACE_FORK      1   // fork() until the handler runs
+#define TRACE_CONNECT   2   // connecting to the server
+#define TRACE_BUFFER    3   // request being buffered
+#define TRACE_INSPECT   4   // client_callback
+#define TRACE_BACKEND   5   // request forwarded until the server answers
+#define TRACE_CLOSE     6   // connection closed
+#define TRACE_STAGES    7
+
+
+struct proxy_trace {
+    int active;
+    int pid;                    // process recording the events
+    unsigned long connection;   // connection sequence number, the track id
+    unsigned long ring;         // ring the events go to
+    unsigned open_stages;       // bit mask of stages with an open span
+    uint64_t begin[TRACE_STAGES];   // TSC at which each open span began
+};
+
+
+/*
+    The check of trace->active is inlined so that untraced connections only
+    pay for a predictable branch, and with TRACE_SAMPLE_RATE 0 it folds away.
+*/
+#define TRACE_ACTIVE(trace) \
+    (TRACE_SAMPLE_RATE != 0 && __builtin_expect((trace)->active, 0))
+
+#define TRACE_BEGIN(trace, stage) \
+    do { \
+        if(TRACE_ACTIVE(trace)) { \
+            trace_begin((trace), (stage)); \
+        } \
+    } while(0)
+
+#define TRACE_END(trace, stage) \
+    do { \
+        if(TRACE_ACTIVE(trace)) { \
+            trace_end((trace), (stage)); \
+        } \
+    } while(0)
+
+#define TRACE_INSTANT(trace, stage) \
+    do { \
+        if(TRACE_ACTIVE(trace)) { \
+            trace_instant((trace), (stage)); \
+        } \
+    } while(0)
+
+#define TRACE_CHILD(trace) \
+    do { \
+        if(TRACE_ACTIVE(trace)) { \
+            trace_child(trace); \
+        } \
+    } while(0)
+
+
+void trace_init();
+
+void trace_start(struct proxy_trace *trace);
+
+void trace_child(struct proxy_trace *trace);
+
+void trace_begin(
+    struct proxy_trace *trace,
+    int stage
+);
+
+void trace_end(
+    struct proxy_trace *trace,
+    int stage
+);
+
+void trace_instant(
+    struct proxy_trace *trace,
+    int stage
+);
+
+void trace_finish(struct proxy_trace *trace);
+
+int trace_dump(const char *path);
+
+
+#endif // PROXY_TRACE_H_
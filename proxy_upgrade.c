@@ -0,0 +1,204 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+/**********
+ * INCLUDES
+ **********/
+
+#include <stdio.h>
+#include <string.h>     // for memset() and strncpy()
+#include <unistd.h>     // for close() and unlink()
+#include <sys/socket.h> // for sendmsg() and recvmsg()
+#include <sys/un.h>     // for sockaddr_un
+#include <sys/time.h>   // for timeval
+#include <syslog.h>
+#include "proxy_upgrade.h"
+
+/*********
+ * DEFINES
+ *********/
+
+// how long the old proxy waits for the new one to confirm the handoff
+#define UPGRADE_ACK_TIMEOUT_S 5
+
+/*********************
+ * STATIC DECLARATIONS
+ *********************/
+
+static void construct_sockaddr_un(struct sockaddr_un *sock_addr);
+
+/**********************
+ * FUNCTION DEFINITIONS
+ **********************/
+
+int upgrade_receive_listener() {
+
+/*
+    Asks a running proxy for its listening socket. Returns the socket, or -1 if
+    no proxy is running or the handoff failed, in which case the caller should
+    bind a listening socket of its own.
+*/
+    
+    int control_socket;
+    struct sockaddr_un control_addr;
+    struct msghdr message;
+    struct iovec iov;
+    struct cmsghdr *control_message;
+    char control_buffer[CMSG_SPACE(sizeof(int))];
+    char byte;
+    int listener = -1;
+    
+    if((control_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        return -1;
+    }
+    
+    construct_sockaddr_un(&control_addr);
+    
+    if(connect(control_socket, (struct sockaddr *) &control_addr, sizeof(control_addr)) < 0) {
+        close(control_socket);
+        return -1;
+    }
+    
+    memset(&message, 0, sizeof(message));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control_buffer;
+    message.msg_controllen = sizeof(control_buffer);
+    
+    if(recvmsg(control_socket, &message, 0) > 0) {
+        control_message = CMSG_FIRSTHDR(&message);
+        
+        if(control_message != NULL
+            && control_message->cmsg_level == SOL_SOCKET
+            && control_message->cmsg_type == SCM_RIGHTS) {
+            
+            memcpy(&listener, CMSG_DATA(control_message), sizeof(int));
+            
+            // tell the old proxy it can stop accepting
+            if(send(control_socket, &byte, 1, 0) != 1) {
+                close(listener);
+                listener = -1;
+            }
+        }
+    }
+    
+    close(control_socket);
+    return listener;
+}
+
+int upgrade_init_control_socket() {
+
+/*
+    Starts listening for upgrade requests. Failure is not fatal, it only means
+    this proxy can't hand its listening socket over, so -1 is returned.
+*/
+    
+    int control_socket;
+    struct sockaddr_un control_addr;
+    
+    if((control_socket = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        syslog(LOG_WARNING, "upgrade socket() failed: %m\n");
+        return -1;
+    }
+    
+    construct_sockaddr_un(&control_addr);
+    
+    // a previous proxy may still hold the old socket, but it no longer needs
+    // the path
+    unlink(UPGRADE_SOCKET_PATH);
+    
+    if(bind(control_socket, (struct sockaddr *) &control_addr, sizeof(control_addr)) < 0
+        || listen(control_socket, 1) < 0) {
+        
+        syslog(LOG_WARNING, "upgrade socket bind() failed: %m\n");
+        close(control_socket);
+        return -1;
+    }
+    
+    return control_socket;
+}
+
+int upgrade_send_listener(
+    int control_socket,
+    int listener) {
+
+/*
+    Accepts an upgrade request on control_socket and passes listener to the
+    new proxy. Returns 0 once the new proxy has confirmed that it has the
+    socket, -1 otherwise.
+*/
+    
+    int upgrade_socket;
+    struct timeval ack_timeout = {UPGRADE_ACK_TIMEOUT_S, 0};
+    struct msghdr message;
+    struct iovec iov;
+    struct cmsghdr *control_message;
+    char control_buffer[CMSG_SPACE(sizeof(int))];
+    char byte = 0;
+    int status = 0;
+    
+    if((upgrade_socket = accept(control_socket, NULL, NULL)) < 0) {
+        return -1;
+    }
+    
+    memset(&message, 0, sizeof(message));
+    memset(control_buffer, 0, sizeof(control_buffer));
+    iov.iov_base = &byte;
+    iov.iov_len = 1;
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control_buffer;
+    message.msg_controllen = sizeof(control_buffer);
+    
+    control_message = CMSG_FIRSTHDR(&message);
+    control_message->cmsg_level = SOL_SOCKET;
+    control_message->cmsg_type = SCM_RIGHTS;
+    control_message->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(control_message), &listener, sizeof(int));
+    
+    setsockopt(
+        upgrade_socket,
+        SOL_SOCKET,
+        SO_RCVTIMEO,
+        &ack_timeout,
+        sizeof(ack_timeout)
+    );
+    
+    if(sendmsg(upgrade_socket, &message, 0) < 0
+        || recv(upgrade_socket, &byte, 1, 0) != 1) {
+        
+        status = -1;
+    }
+    
+    close(upgrade_socket);
+    return status;
+}
+
+static void construct_sockaddr_un(struct sockaddr_un *sock_addr) {
+    memset(sock_addr, 0, sizeof(*sock_addr));
+    sock_addr->sun_family = AF_UNIX;
+    strncpy(
+        sock_addr->sun_path,
+        UPGRADE_SOCKET_PATH,
+        sizeof(sock_addr->sun_path) - 1
+    );
+}
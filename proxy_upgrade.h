@@ -0,0 +1,48 @@
+/*
+    Copyright 2013 David Scholberg <recombinant.vector@gmail.com>
+
+    This file is part of apache_ips.
+
+    apache_ips is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    apache_ips is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with apache_ips.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef PROXY_UPGRADE_H_
+#define PROXY_UPGRADE_H_
+
+
+/*
+    Listening socket handoff for binary upgrades. A running proxy listens on
+    the Unix socket UPGRADE_SOCKET_PATH. A newly started proxy first connects
+    to it and, if someone answers, receives the listening socket over it
+    (SCM_RIGHTS) instead of binding its own. The old proxy then stops
+    accepting and exits once its in-flight connections have finished.
+*/
+
+#ifndef UPGRADE_SOCKET_PATH
+#define UPGRADE_SOCKET_PATH "/var/run/apache_ips.sock"
+#endif
+
+
+int upgrade_receive_listener();
+
+int upgrade_init_control_socket();
+
+int upgrade_send_listener(
+    int control_socket,
+    int listener
+);
+
+
+#endif // PROXY_UPGRADE_H_
@@ -21,6 +21,8 @@
  * INCLUDES
  **********/
 
+#define _GNU_SOURCE     // for ppoll()
+
 #include <stdio.h>      // for printf() and fprintf()
 #include <sys/socket.h> // for socket(), bind(), and connect()
 #include <arpa/inet.h>  // for sockaddr_in and inet_ntoa()
@@ -30,14 +32,118 @@
 #include <errno.h>
 #include <signal.h>
 #include <syslog.h>
+#include <poll.h>       // for poll()
+#include <fcntl.h>      // for fcntl()
+#include <sys/wait.h>   // for wait()
+#include <sys/time.h>   // for timeval
+#include <sys/ioctl.h>  // for ioctl()
+#include <linux/sockios.h>  // for SIOCOUTQ
 #include "reverse_proxy.h"
+#include "proxy_cache.h"
+#include "proxy_inspect_pool.h"
+#include "proxy_memory.h"
+#include "proxy_overload.h"
+#include "proxy_stats.h"
+#include "proxy_timer.h"
+#include "proxy_trace.h"
+#include "proxy_upgrade.h"
 
 /*********
  * DEFINES
  *********/
 
-#define MAXPENDING 5    // Maximum outstanding connection requests 
-#define BUFFERSIZE 1000000
+#ifndef MAXPENDING
+#define MAXPENDING 128  // Maximum outstanding connection requests 
+#endif
+
+/*
+    Per-connection deadlines. A client gets HEADER_TIMEOUT_MS to complete each
+    request header, and while a request is being buffered it must keep sending
+    at least MIN_CLIENT_RATE bytes per second, measured over
+    RATE_CHECK_INTERVAL_MS windows. A connection with no traffic in either
+    direction for IDLE_TIMEOUT_MS is closed, as is any connection older than
+    LIFETIME_TIMEOUT_MS. Once either side has closed, what is left for the
+    other side is sent on for at most DRAIN_TIMEOUT_MS.
+*/
+#ifndef HEADER_TIMEOUT_MS
+#define HEADER_TIMEOUT_MS 10000
+#endif
+
+#ifndef MIN_CLIENT_RATE
+#define MIN_CLIENT_RATE 100
+#endif
+
+#ifndef RATE_CHECK_INTERVAL_MS
+#define RATE_CHECK_INTERVAL_MS 5000
+#endif
+
+#ifndef IDLE_TIMEOUT_MS
+#define IDLE_TIMEOUT_MS 60000
+#endif
+
+#ifndef LIFETIME_TIMEOUT_MS
+#define LIFETIME_TIMEOUT_MS 3600000
+#endif
+
+#ifndef DRAIN_TIMEOUT_MS
+#define DRAIN_TIMEOUT_MS 30000
+#endif
+
+// how often a request that may not grow its buffer for now asks again
+#ifndef BUFFER_RETRY_MS
+#define BUFFER_RETRY_MS 100
+#endif
+
+// sent when a request header does not fit in the client buffer
+#define RESPONSE_431 \
+    "HTTP/1.1 431 Request Header Fields Too Large\r\n" \
+    "Content-Length: 0\r\n" \
+    "Connection: close\r\n" \
+    "\r\n"
+
+// sent when a request is refused because inspection is overloaded
+#define RESPONSE_503 \
+    "HTTP/1.1 503 Service Unavailable\r\n" \
+    "Content-Length: 0\r\n" \
+    "Retry-After: 1\r\n" \
+    "Connection: close\r\n" \
+    "\r\n"
+
+/*********
+ * STRUCTS
+ *********/
+
+struct connection_timeouts {
+    struct timer_wheel wheel;
+    struct proxy_timer header_timer;
+    struct proxy_timer rate_timer;
+    struct proxy_timer idle_timer;
+    struct proxy_timer lifetime_timer;
+    struct proxy_timer drain_timer;     // armed once a side has closed
+    int buffering;          // client_callback last returned PROXY_BUFFER
+    int was_buffering;      // buffering at the previous rate check
+    long rate_bytes;        // client bytes received since the last rate check
+    const char *reason;     // set to the name of the first expired deadline
+    int client_socket;
+    int client_unsent;      // bytes the kernel held for the client when the
+                            // idle deadline last expired
+};
+
+/*
+    Micro-cache state of a connection. A response can only be captured for
+    the cache while every earlier response on the connection has been
+    received in full, since responses are otherwise not delimited; usable is
+    cleared once that is no longer known.
+*/
+struct connection_cache {
+    int usable;
+    int client_socket;
+    int server_socket;
+    char *request;          // request whose response is being captured
+    int request_size;
+    char *response;
+    int response_size;
+};
 
 /*********************
  * STATIC DECLARATIONS
@@ -52,9 +158,92 @@
 int (*client_callback)(const char *, int);
 int (*server_callback)(const char *, int);
 
+/*
+    route_callback is set when out-of-band inspection is enabled. It is called
+    with client data before client_callback, and returns PROXY_INSPECT_ASYNC
+    if the data is a complete request that may be forwarded right away and
+    inspected by client_callback in the background, or PROXY_INSPECT_INLINE
+    otherwise.
+*/
+int (*route_callback)(const char *, int) = NULL;
+
+// inspection workers of a connection handler, created on first use
+static struct inspect_pool *inspect_pool = NULL;
+
+// timer_now_ms() at process start, see reverse_proxy_mark_startup()
+static uint64_t startup_time = 0;
+
+// set by the SIGUSR1 handler, checked by the accept loop
+static volatile sig_atomic_t stats_requested = 0;
+
+// set by the SIGUSR2 handler, checked by the accept loop
+static volatile sig_atomic_t trace_requested = 0;
+
+// set by the SIGCHLD handler, checked by the accept loop
+static volatile sig_atomic_t children_exited = 0;
+
 
 static void die(char *error_message);
 
+static void request_stats(int signal_number);
+
+static void request_trace(int signal_number);
+
+static void child_exited(int signal_number);
+
+static void handle_requests();
+
+static void reap_children();
+
+static void init_connection_timeouts(
+    struct connection_timeouts *timeouts,
+    int client_socket
+);
+
+static void update_client_timeouts(
+    struct connection_timeouts *timeouts,
+    int client_verdict
+);
+
+static void header_timeout(void *arg);
+
+static void rate_check(void *arg);
+
+static void idle_timeout(void *arg);
+
+static void lifetime_timeout(void *arg);
+
+static void start_drain_timeout(struct connection_timeouts *timeouts);
+
+static void drain_timeout(void *arg);
+
+static char *buffer_alloc(int *buffer_size);
+
+static int buffer_grow(
+    char **buffer,
+    int *buffer_size,
+    int buffer_bytes
+);
+
+static void buffer_trim(
+    char **buffer,
+    int *buffer_size,
+    int buffer_bytes
+);
+
+static void buffer_append(
+    char **buffer,
+    int *buffer_size,
+    int *buffer_bytes,
+    const char *data,
+    int data_size
+);
+
+static void buffer_free(
+    char *buffer,
+    int buffer_size
+);
+
 static void construct_sockaddr_in(
     struct sockaddr_in *sock_addr,
     uint32_t ip_address,
@@ -63,13 +252,50 @@ static void construct_sockaddr_in(
 
 static int init_local_server_socket();
 
+static void drain_and_exit();
+
 static int init_remote_server_socket();
 
 static void handle_client_socket(
     int remote_client_socket,
-    char *client_addr
+    char *client_addr,
+    struct proxy_trace *trace
+);
+
+static int inspect_client_data(
+    const char *client_data,
+    int data_size,
+    int *inspected_async
+);
+
+static int cache_client_request(
+    struct connection_cache *cache,
+    const char *request,
+    int request_size,
+    int inspected_async,
+    char **response,
+    int *response_size
+);
+
+static void cache_server_data(
+    struct connection_cache *cache,
+    const char *server_data,
+    int data_size
+);
+
+static void end_cache_capture(
+    struct connection_cache *cache,
+    int store
+);
+
+static void revalidate_cache_entry(
+    struct connection_cache *cache,
+    const char *request,
+    int request_size
 );
 
+static void reset_socket(int socket);
+
 /**********************
  * FUNCTION DEFINITIONS
  **********************/
@@ -84,31 +310,142 @@ void reverse_proxy(
     client_callback = client_callback_arg;
     server_callback = server_callback_arg;
     
-    // ignore child process return values to prevent zombie processes
+    // Reap child processes from the accept loop, so that the memory charges
+    // of handlers that were killed can be reclaimed. Interrupted system calls
+    // other than poll() are restarted.
     struct sigaction sig_action;
-    sig_action.sa_handler = SIG_IGN;
+    sig_action.sa_handler = child_exited;
     sigemptyset(&sig_action.sa_mask);
-    sig_action.sa_flags = 0;
+    sig_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
     
     if(sigaction(SIGCHLD, &sig_action, NULL) < 0) {
         die("sigaction() failed");
     }
     
+    // a client that goes away mid-send must not kill its handler
+    sig_action.sa_handler = SIG_IGN;
+    sig_action.sa_flags = 0;
+    
+    if(sigaction(SIGPIPE, &sig_action, NULL) < 0) {
+        die("sigaction() failed");
+    }
+    
+    // log the shared counters on SIGUSR1
+    sig_action.sa_handler = request_stats;
+    
+    if(sigaction(SIGUSR1, &sig_action, NULL) < 0) {
+        die("sigaction() failed");
+    }
+    
+    // dump the traces of sampled connections on SIGUSR2
+    sig_action.sa_handler = request_trace;
+    
+    if(sigaction(SIGUSR2, &sig_action, NULL) < 0) {
+        die("sigaction() failed");
+    }
+    
     // set up logging
     openlog("reverse_proxy", LOG_PID, LOG_USER);
     
-    int local_server_socket = init_local_server_socket();
-
+    proxy_stats_init();
+    memory_init();
+    trace_init();
+    
+    if(CACHE_ENABLED) {
+        cache_init();
+    }
+    
+    if(startup_time == 0) {
+        reverse_proxy_mark_startup();
+    }
+    
+    int first_accept = 1;
+    
+    // take over the listening socket of a running proxy if there is one
+    int local_server_socket = upgrade_receive_listener();
+    int inherited_listener = (local_server_socket >= 0);
+    
+    if(!inherited_listener) {
+        local_server_socket = init_local_server_socket();
+    }
+    
+    // the listening socket is shared with the old or the next proxy while an
+    // upgrade is in progress, so never block in accept()
+    fcntl(
+        local_server_socket,
+        F_SETFL,
+        fcntl(local_server_socket, F_GETFL) | O_NONBLOCK
+    );
+    
+    syslog(
+        LOG_INFO,
+        "listening %lu ms after startup (%s listening socket)\n",
+        (unsigned long) (timer_now_ms() - startup_time),
+        inherited_listener ? "inherited" : "new"
+    );
+    
+    int control_socket = upgrade_init_control_socket();
+    
     // init variables for client_socket
     int client_socket;
     struct sockaddr_in client_addr;
     unsigned int client_len;  // Length of client address data structure
+    struct pollfd poll_fds[2];
+    struct proxy_trace trace;
+    sigset_t signals;
+    sigset_t wait_mask;
+    
+    // The signals served by handle_requests() are only delivered while the
+    // loop waits in ppoll(), so that one arriving while a connection is
+    // accepted is served on the next iteration rather than with the next
+    // signal.
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGCHLD);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &signals, &wait_mask);
+    
+    poll_fds[0].fd = local_server_socket;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = control_socket;    // ignored by poll() if -1
+    poll_fds[1].events = POLLIN;
 
     for (;;) {
+        // reap handlers and serve stats and trace requests
+        handle_requests();
+        
+        // Wait for a client to connect or for an upgrade request. ppoll() is
+        // interrupted by SIGCHLD, SIGUSR1 and SIGUSR2.
+        if(ppoll(poll_fds, 2, NULL, &wait_mask) < 0) {
+            if(errno != EINTR) {
+                die("poll() failed");
+            }
+            continue;
+        }
+        
+        // hand the listening socket to a new proxy and stop accepting
+        if(poll_fds[1].revents & POLLIN) {
+            if(upgrade_send_listener(control_socket, local_server_socket)
+                == 0) {
+                
+                syslog(LOG_INFO, "listening socket handed off\n");
+                close(local_server_socket);
+                close(control_socket);
+                sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+                drain_and_exit();
+            }
+            
+            syslog(LOG_WARNING, "listening socket handoff failed\n");
+        }
+        
+        if(!(poll_fds[0].revents & POLLIN)) {
+            continue;
+        }
+        
         // Set the size of the in-out parameter
         client_len = sizeof(client_addr);
 
-        // Wait for a client to connect
+        // Accept the client connection
         client_socket = accept(
             local_server_socket,
             (struct sockaddr *) &client_addr, 
@@ -116,18 +453,71 @@ void reverse_proxy(
         );
         
         if (client_socket < 0) {
+            // another process sharing the socket got there first, or the
+            // client gave up
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR
+                || errno == ECONNABORTED) {
+                
+                continue;
+            }
             die("accept() failed");
         }
+        
+        PROXY_STATS_INC(connections_accepted);
+        trace_start(&trace);
+        TRACE_INSTANT(&trace, TRACE_ACCEPT);
+        
+        // keep capacity for established connections while overloaded
+        if(OVERLOAD_POLICY == OVERLOAD_PRIORITIZE_ESTABLISHED
+            && overload_active()) {
+            
+            send(
+                client_socket,
+                RESPONSE_503,
+                strlen(RESPONSE_503),
+                MSG_DONTWAIT
+            );
+            close(client_socket);
+            PROXY_STATS_INC(overload_shed_new);
+            continue;
+        }
+        
+        if(first_accept) {
+            first_accept = 0;
+            syslog(
+                LOG_INFO,
+                "first accept %lu ms after startup\n",
+                (unsigned long) (timer_now_ms() - startup_time)
+            );
+        }
 
         printf("Handling client %s\n", inet_ntoa(client_addr.sin_addr));
 
         // Create child process to handle client connection
+        TRACE_BEGIN(&trace, TRACE_FORK);
         int pid = fork();
         if(pid == 0) {
+            TRACE_CHILD(&trace);
             printf("I'm the child, yo\n");
+            
+            // signals for the accepting process must not interrupt the
+            // connection handler, which leaves its own children to init
+            sig_action.sa_handler = SIG_IGN;
+            sigaction(SIGUSR1, &sig_action, NULL);
+            sigaction(SIGUSR2, &sig_action, NULL);
+            sigaction(SIGCHLD, &sig_action, NULL);
+            sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+            
+            memory_attach();
+            
+            close(local_server_socket);
+            if(control_socket >= 0) {
+                close(control_socket);
+            }
             handle_client_socket(
                 client_socket,
-                inet_ntoa(client_addr.sin_addr)
+                inet_ntoa(client_addr.sin_addr),
+                &trace
             );
         }
         else if (pid < 0) {
@@ -141,49 +531,142 @@ void reverse_proxy(
 }
 
 
+void reverse_proxy_async_inspection(
+    int (*route_callback_arg)(const char *, int)) {
+
+/*
+    Enables out-of-band inspection for requests that route_callback_arg
+    accepts. Such requests are forwarded without waiting for client_callback,
+    which runs on a pool of inspection threads instead. If it returns
+    PROXY_BLOCK while the connection is still open, both sides of the
+    connection are reset. Must be called before reverse_proxy().
+*/
+    
+    route_callback = route_callback_arg;
+}
+
+void reverse_proxy_mark_startup() {
+
+/*
+    Records the time the process started, from which the time until the proxy
+    is listening and until the first connection is accepted are logged. Meant
+    to be called first thing in main(), so that initialization done before
+    reverse_proxy() is counted. Otherwise reverse_proxy() calls it.
+*/
+    
+    startup_time = timer_now_ms();
+}
+
 static void handle_client_socket(
     int remote_client_socket,
-    char *client_addr) {
+    char *client_addr,
+    struct proxy_trace *trace) {
 
 /*
     This is the function that proxies the connection between the connected
     client and the predefined server. This function is only called by child
     processes and does not return. It calls exit() after either the client or
-    the server closes the connection, or one of the callback functions returns
-    PROXY_BLOCK.
+    the server closes the connection, one of the callback functions returns
+    PROXY_BLOCK, or one of the connection deadlines expires.
+
+    When one side closes, data already received from the other side is still
+    delivered. A server that closes, as HTTP/1.0 servers do after a response,
+    leaves the rest of its response to be sent to the client. A client that
+    closes its side after a request still gets the response, and the close is
+    passed on to the server once the request has been forwarded.
+
+    The server connection is only made once there is a request to forward, so
+    that connections served from the cache don't tie up the server.
+
+    If the connection is sampled, trace records how long it spends in each
+    stage, see proxy_trace.h.
 */
     
-    char client_buffer[BUFFERSIZE];
-    char server_buffer[BUFFERSIZE];
+    int remote_server_socket = -1;
+    int client_buffer_size;
+    int server_buffer_size;
+    char *client_buffer = buffer_alloc(&client_buffer_size);
+    char *server_buffer = buffer_alloc(&server_buffer_size);
     
-    int remote_server_socket = init_remote_server_socket();
+    int client_room;
+    int server_room;
     int bytes_read;
     int bytes_sent;
     int client_bytes = 0;
     int server_bytes = 0;
     int client_verdict = PROXY_ALLOW;
     int server_verdict = PROXY_ALLOW;
+    int reset_connection = 0;
+    int client_closed = 0;
+    int server_closed = 0;
+    int server_shut_down = 0;   // the client's close was passed on
+    int poll_timeout;
+    int inspected_async;
+    char *cached_response;
+    int cached_response_size;
+    struct pollfd poll_fds[3];
+    struct connection_timeouts timeouts;
+    struct connection_cache cache = {
+        CACHE_ENABLED,
+        remote_client_socket,
+        remote_server_socket,
+        NULL,
+        0,
+        NULL,
+        0
+    };
+    
+    init_connection_timeouts(&timeouts, remote_client_socket);
+    
+    poll_fds[0].fd = remote_client_socket;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = -1;    // server socket, once connected
+    poll_fds[1].events = POLLIN;
+    poll_fds[2].fd = -1;    // verdicts of out-of-band inspection, if any
+    poll_fds[2].events = POLLIN;
     
     // proxy loop
     // read from client, write to server, read from server, write to client
     while(1) {
         
         // write client data to server socket
-        if(client_verdict == PROXY_ALLOW && client_bytes > 0) {
+        if(client_verdict == PROXY_ALLOW && client_bytes > 0
+            && !server_closed) {
+            
+            if(remote_server_socket < 0) {
+                TRACE_BEGIN(trace, TRACE_CONNECT);
+                remote_server_socket = init_remote_server_socket();
+                TRACE_END(trace, TRACE_CONNECT);
+                poll_fds[1].fd = remote_server_socket;
+                cache.server_socket = remote_server_socket;
+            }
+            
             bytes_sent = send(
                 remote_server_socket,
                 client_buffer,
                 client_bytes,
-                0
+                MSG_DONTWAIT
             );
             
-            // if error returned, break out of proxy loop
+            // if any error but a blocking error is returned, break out of
+            // proxy loop. Otherwise the rest is sent once poll() reports room.
             if(bytes_sent < 0) {
-                break;
+                if(errno != EWOULDBLOCK && errno != EAGAIN) {
+                    break;
+                }
+                bytes_sent = 0;
             }
             
             // subract # of bytes sent from current # of bytes to send
             client_bytes -= bytes_sent;
+            if(bytes_sent > 0) {
+                TRACE_BEGIN(trace, TRACE_BACKEND);
+                timer_add(
+                    &timeouts.wheel,
+                    &timeouts.idle_timer,
+                    timer_now_ms() + IDLE_TIMEOUT_MS
+                );
+            }
             
             // if there's still data to send, move it to front of the buffer
             if(client_bytes > 0) {
@@ -195,22 +678,43 @@ static void handle_client_socket(
             }
         }
         
+        // pass the client's close on once everything it sent has been
+        // forwarded, so that the server closes in turn after responding
+        if(client_closed && !server_shut_down && remote_server_socket >= 0
+            && (client_verdict != PROXY_ALLOW || client_bytes == 0)) {
+            
+            shutdown(remote_server_socket, SHUT_WR);
+            server_shut_down = 1;
+        }
+        
         // write server data to client socket
         if(server_verdict == PROXY_ALLOW && server_bytes > 0) {
             bytes_sent = send(
                 remote_client_socket,
                 server_buffer,
                 server_bytes,
-                0
+                MSG_DONTWAIT
             );
             
-            // if error returned, break out of proxy loop
+            // if any error but a blocking error is returned, break out of
+            // proxy loop. A client that doesn't read must not stall the
+            // handler, or the deadlines below could never expire.
             if(bytes_sent < 0) {
-                break;
+                if(errno != EWOULDBLOCK && errno != EAGAIN) {
+                    break;
+                }
+                bytes_sent = 0;
             }
             
             // subract # of bytes sent from current # of bytes to send
             server_bytes -= bytes_sent;
+            if(bytes_sent > 0) {
+                timer_add(
+                    &timeouts.wheel,
+                    &timeouts.idle_timer,
+                    timer_now_ms() + IDLE_TIMEOUT_MS
+                );
+            }
             
             // if there's still data to send, move it to front of the buffer
             if(server_bytes > 0) {
@@ -222,90 +726,599 @@ static void handle_client_socket(
             }
         }
         
-        // read from client socket
-        bytes_read = recv(
-            remote_client_socket,
-            client_buffer + client_bytes,
-            BUFFERSIZE - client_bytes,
-            MSG_DONTWAIT
+        // nothing more is coming for the client once the server has closed,
+        // or once the client has closed before anything was forwarded
+        if((server_closed || (client_closed && remote_server_socket < 0))
+            && (server_verdict != PROXY_ALLOW || server_bytes == 0)) {
+            
+            break;
+        }
+        
+        // give memory back if this connection holds more than it may now have
+        buffer_trim(&client_buffer, &client_buffer_size, client_bytes);
+        buffer_trim(&server_buffer, &server_buffer_size, server_bytes);
+        
+        // make room for more data. A side whose buffer is full and can't grow
+        // isn't read from until the data in its buffer has been sent on.
+        client_room = buffer_grow(
+            &client_buffer,
+            &client_buffer_size,
+            client_bytes
+        );
+        server_room = buffer_grow(
+            &server_buffer,
+            &server_buffer_size,
+            server_bytes
         );
         
-        // if any error but a blocking error is returned, or if the socket was 
-        // closed on the other end, break out of proxy loop
-        if((bytes_read < 0 && (errno != EWOULDBLOCK || errno != EAGAIN))
-            || bytes_read == 0) {
+        // a buffered request that fills the largest buffer has a header that
+        // is too large for us to inspect. A smaller buffer only means that
+        // the memory budget is tight, and the request waits for memory,
+        // bounded by the header deadline.
+        if(!client_room && client_verdict == PROXY_BUFFER && !client_closed
+            && client_buffer_size >= BUFFER_MAX_SIZE) {
             
+            send(
+                remote_client_socket,
+                RESPONSE_431,
+                strlen(RESPONSE_431),
+                MSG_DONTWAIT
+            );
+            PROXY_STATS_INC(headers_too_large);
+            syslog(
+                LOG_WARNING,
+                "header from %s was too large\n",
+                client_addr
+            );
+            break;
+        }
+        
+        poll_fds[0].events = client_room && !client_closed ? POLLIN : 0;
+        poll_fds[1].events = server_room ? POLLIN : 0;
+        
+        // wait for room to send whatever is left over
+        if(client_verdict == PROXY_ALLOW && client_bytes > 0) {
+            poll_fds[1].events |= POLLOUT;
+        }
+        if(server_verdict == PROXY_ALLOW && server_bytes > 0) {
+            poll_fds[0].events |= POLLOUT;
+        }
+        
+        if(inspect_pool != NULL) {
+            poll_fds[2].fd = inspect_pool_verdict_fd(inspect_pool);
+        }
+        
+        // wait for data from either socket, or until the next timer is due.
+        // Errors are caught by the recv() calls below. Memory given back by
+        // other connections wakes nobody, so a request waiting for memory
+        // asks again every BUFFER_RETRY_MS.
+        poll_timeout = timer_wheel_timeout(&timeouts.wheel, timer_now_ms());
+        if(!client_room && client_verdict == PROXY_BUFFER
+            && poll_timeout > BUFFER_RETRY_MS) {
+            
+            poll_timeout = BUFFER_RETRY_MS;
+        }
+        
+        poll(poll_fds, 3, poll_timeout);
+        
+        // out-of-band inspection blocked data that has already been forwarded
+        if(inspect_pool != NULL && inspect_pool_blocked(inspect_pool)) {
+            syslog(
+                LOG_WARNING,
+                "data from %s was rejected after forwarding\n",
+                client_addr
+            );
+            PROXY_STATS_INC(async_resets);
+            reset_connection = 1;
+            break;
+        }
+        
+        // a client that has closed is only polled for room to send to it,
+        // and an error there means it is gone altogether
+        if(client_closed && (poll_fds[0].revents & (POLLERR | POLLHUP))) {
             break;
         }
         
-        // if some data was recieved, add # of received bytes to current # of
-        // bytes in buffer and call client_callback
-        if(bytes_read > 0) {
-            client_bytes += bytes_read;
+        timer_wheel_advance(&timeouts.wheel, timer_now_ms());
+        
+        if(timeouts.reason != NULL) {
+            syslog(
+                LOG_WARNING,
+                "connection from %s timed out (%s)\n",
+                client_addr,
+                timeouts.reason
+            );
+            break;
+        }
+        
+        // read from client socket
+        if(client_room && !client_closed) {
+            bytes_read = recv(
+                remote_client_socket,
+                client_buffer + client_bytes,
+                client_buffer_size - client_bytes,
+                MSG_DONTWAIT
+            );
             
-            // if client_callback rejects client data, break out of proxy loop
-            if(client_callback != NULL) {
-                client_verdict = client_callback(client_buffer, client_bytes);
+            // if any error but a blocking error is returned, break out of
+            // proxy loop
+            if(bytes_read < 0 && (errno != EWOULDBLOCK || errno != EAGAIN)) {
+                break;
+            }
+            
+            // if the socket was closed on the other end, stop reading from
+            // it but keep sending it the response
+            if(bytes_read == 0) {
+                client_closed = 1;
+                start_drain_timeout(&timeouts);
+            }
             
-                if(client_verdict == PROXY_BLOCK) {
-                    syslog(
-                        LOG_WARNING,
-                        "data from %s was rejected\n",
-                        client_addr
+            // if some data was recieved, add # of received bytes to current #
+            // of bytes in buffer and call client_callback
+            if(bytes_read > 0) {
+                client_bytes += bytes_read;
+                timeouts.rate_bytes += bytes_read;
+                timer_add(
+                    &timeouts.wheel,
+                    &timeouts.idle_timer,
+                    timer_now_ms() + IDLE_TIMEOUT_MS
+                );
+                inspected_async = 0;
+            
+                // if client_callback rejects client data, break out of proxy
+                // loop
+                if(client_callback != NULL) {
+                    // refuse requests uninspected while overloaded
+                    if(OVERLOAD_POLICY == OVERLOAD_FAIL_CLOSED
+                        && overload_active()) {
+                        
+                        send(
+                            remote_client_socket,
+                            RESPONSE_503,
+                            strlen(RESPONSE_503),
+                            MSG_DONTWAIT
+                        );
+                        PROXY_STATS_INC(overload_rejected);
+                        break;
+                    }
+                    
+                    TRACE_BEGIN(trace, TRACE_INSPECT);
+                    client_verdict = inspect_client_data(
+                        client_buffer,
+                        client_bytes,
+                        &inspected_async
                     );
-                    break;
+                    TRACE_END(trace, TRACE_INSPECT);
+            
+                    if(client_verdict == PROXY_BLOCK) {
+                        syslog(
+                            LOG_WARNING,
+                            "data from %s was rejected\n",
+                            client_addr
+                        );
+                        break;
+                    }
+                
+                    if(client_verdict == PROXY_BUFFER) {
+                        TRACE_BEGIN(trace, TRACE_BUFFER);
+                        syslog(
+                            LOG_INFO,
+                            "data from %s was buffered\n",
+                            client_addr
+                        );
+                    }
+                    else {
+                        TRACE_END(trace, TRACE_BUFFER);
+                    }
                 }
+            
+                update_client_timeouts(&timeouts, client_verdict);
                 
-                if(client_verdict == PROXY_BUFFER) {
-                    syslog(
-                        LOG_INFO,
-                        "data from %s was buffered\n",
-                        client_addr
+                // answer allowed requests from the cache if possible, in
+                // which case there's nothing left to forward. The response
+                // is queued behind whatever the server has sent so far.
+                if(client_verdict == PROXY_ALLOW
+                    && cache_client_request(
+                        &cache,
+                        client_buffer,
+                        client_bytes,
+                        inspected_async,
+                        &cached_response,
+                        &cached_response_size
+                    )) {
+                    
+                    client_bytes = 0;
+                    buffer_append(
+                        &server_buffer,
+                        &server_buffer_size,
+                        &server_bytes,
+                        cached_response,
+                        cached_response_size
                     );
+                    free(cached_response);
                 }
             }
         }
         
         // read from server socket
-        bytes_read = recv(
-            remote_server_socket,
-            server_buffer + server_bytes,
-            BUFFERSIZE - server_bytes,
-            MSG_DONTWAIT
-        );
-        
-        // if any error but a blocking error is returned, or if the socket was 
-        //closed on the other end, break out of proxy loop
-        if((bytes_read < 0 && (errno != EWOULDBLOCK || errno != EAGAIN))
-            || bytes_read == 0) {
+        if(server_room && remote_server_socket >= 0 && !server_closed) {
+            bytes_read = recv(
+                remote_server_socket,
+                server_buffer + server_bytes,
+                server_buffer_size - server_bytes,
+                MSG_DONTWAIT
+            );
             
-            break;
-        }
-        
-        // if some data was recieved, add # of received bytes to current # of
-        // bytes in buffer and call server_callback
-        if(bytes_read > 0) {
-            server_bytes += bytes_read;
+            // if any error but a blocking error is returned, break out of
+            // proxy loop
+            if(bytes_read < 0 && (errno != EWOULDBLOCK || errno != EAGAIN)) {
+                break;
+            }
+            
+            // if the socket was closed on the other end, stop polling it,
+            // and exit once the rest of the response has been sent
+            if(bytes_read == 0) {
+                server_closed = 1;
+                poll_fds[1].fd = -1;
+                start_drain_timeout(&timeouts);
+            }
+            
+            // if some data was recieved, add # of received bytes to current #
+            // of bytes in buffer and call server_callback
+            if(bytes_read > 0) {
+                server_bytes += bytes_read;
+                TRACE_END(trace, TRACE_BACKEND);
+                timer_add(
+                    &timeouts.wheel,
+                    &timeouts.idle_timer,
+                    timer_now_ms() + IDLE_TIMEOUT_MS
+                );
+                cache_server_data(
+                    &cache,
+                    server_buffer + server_bytes - bytes_read,
+                    bytes_read
+                );
             
-            // if server_callback rejects server data, break out of proxy loop
-            if(server_callback != NULL) {
-                server_verdict = server_callback(server_buffer, server_bytes);
+                // if server_callback rejects server data, break out of proxy
+                // loop
+                if(server_callback != NULL) {
+                    server_verdict = server_callback(
+                        server_buffer,
+                        server_bytes
+                    );
                 
-                if(server_verdict == PROXY_BLOCK) {
-                    break;
+                    if(server_verdict == PROXY_BLOCK) {
+                        break;
+                    }
                 }
             }
         }
     }
     
-    // cleanly close both sockets (FIN, FIN ACK)
-    close(remote_server_socket);
+    // abort both connections if out-of-band inspection blocked them,
+    // otherwise cleanly close both sockets (FIN, FIN ACK)
+    if(reset_connection) {
+        reset_socket(remote_server_socket);
+        reset_socket(remote_client_socket);
+    }
+    
+    if(remote_server_socket >= 0) {
+        close(remote_server_socket);
+    }
     close(remote_client_socket);
     
-    exit(0); // exit child process
+    buffer_free(client_buffer, client_buffer_size);
+    buffer_free(server_buffer, server_buffer_size);
+    end_cache_capture(&cache, 0);
+    
+    // verdicts of out-of-band inspections that are still pending would die
+    // with this process, and a detection must be recorded even if it is too
+    // late to reset the connection
+    if(inspect_pool != NULL && !reset_connection) {
+        int unfinished = inspect_pool_drain(
+            inspect_pool,
+            INSPECT_DRAIN_TIMEOUT_MS
+        );
+        
+        if(inspect_pool_blocked(inspect_pool)) {
+            syslog(
+                LOG_WARNING,
+                "data from %s was rejected after the connection closed\n",
+                client_addr
+            );
+            PROXY_STATS_INC(async_late_blocks);
+        }
+        
+        if(unfinished > 0) {
+            syslog(
+                LOG_WARNING,
+                "%d inspections of data from %s did not finish\n",
+                unfinished,
+                client_addr
+            );
+            __sync_fetch_and_add(&proxy_stats->async_unfinished, unfinished);
+        }
+    }
+    trace_finish(trace);
     
-    // make sure to set SA_NOCLDWAIT in parent process to prevent child process
-    // zombification
+    exit(0); // exit child process, reaped by reap_children()
+}
+
+static int inspect_client_data(
+    const char *client_data,
+    int data_size,
+    int *inspected_async) {
+
+/*
+    Returns the verdict on client data. Data that route_callback allows to be
+    inspected out of band is queued for the inspection workers and allowed
+    right away, and *inspected_async is set. Everything else, including data
+    that doesn't fit in the inspection queue, is inspected inline by
+    client_callback.
+*/
+    
+    uint64_t start;
+    uint64_t elapsed;
+    int verdict;
+    
+    if(route_callback != NULL
+        && route_callback(client_data, data_size) == PROXY_INSPECT_ASYNC) {
+        
+        if(inspect_pool == NULL) {
+            inspect_pool = inspect_pool_create(
+                client_callback,
+                INSPECT_POOL_WORKERS
+            );
+        }
+        
+        if(inspect_pool != NULL
+            && inspect_pool_submit(inspect_pool, client_data, data_size)) {
+            
+            PROXY_STATS_INC(async_inspections);
+            *inspected_async = 1;
+            return PROXY_ALLOW;
+        }
+        
+        PROXY_STATS_INC(async_queue_full);
+    }
+    
+    start = timer_now_us();
+    verdict = client_callback(client_data, data_size);
+    elapsed = timer_now_us() - start;
+    
+    PROXY_STATS_INC(inline_inspections);
+    __sync_fetch_and_add(&proxy_stats->inline_inspection_us, elapsed);
+    overload_observe(elapsed);
+    
+    return verdict;
+}
+
+static int cache_client_request(
+    struct connection_cache *cache,
+    const char *request,
+    int request_size,
+    int inspected_async,
+    char **response,
+    int *response_size) {
+
+/*
+    Called with each allowed request. Returns 1 if the request can be answered
+    from the cache, in which case *response is set to the response, which the
+    caller must send and free. Otherwise the request is to be forwarded, and
+    on a cache miss its response is captured for the cache. Requests that
+    haven't been inspected yet are never answered from the cache.
+*/
+    
+    int result;
+    
+    if(!cache->usable) {
+        return 0;
+    }
+    
+    // this request goes to the server while another response is still being
+    // captured, or without being captured, so responses can't be told apart
+    // from here on
+    if(inspected_async || cache->request != NULL) {
+        cache->usable = 0;
+        return 0;
+    }
+    
+    result = cache_lookup(request, request_size, response, response_size);
+    
+    if(result == CACHE_HIT || result == CACHE_STALE) {
+        if(result == CACHE_STALE) {
+            revalidate_cache_entry(cache, request, request_size);
+        }
+        return 1;
+    }
+    
+    if(result == CACHE_MISS) {
+        cache->request = malloc(request_size);
+        
+        if(cache->request != NULL && memory_reserve(CACHE_OBJECT_MAX, 0)) {
+            cache->response = malloc(CACHE_OBJECT_MAX);
+            if(cache->response == NULL) {
+                memory_release(CACHE_OBJECT_MAX);
+            }
+        }
+        
+        if(cache->request == NULL || cache->response == NULL) {
+            cache_abandon(request, request_size);
+            free(cache->request);
+            cache->request = NULL;
+            cache->usable = 0;
+            return 0;
+        }
+        
+        memcpy(cache->request, request, request_size);
+        cache->request_size = request_size;
+        cache->response_size = 0;
+        return 0;
+    }
+    
+    cache->usable = 0;
+    return 0;
+}
+
+static void cache_server_data(
+    struct connection_cache *cache,
+    const char *server_data,
+    int data_size) {
+
+    // adds server data to the response being captured, if any
+    
+    int full_size;
+    
+    if(cache->request == NULL) {
+        return;
+    }
+    
+    if(data_size > CACHE_OBJECT_MAX - cache->response_size) {
+        end_cache_capture(cache, 0);
+        return;
+    }
+    
+    memcpy(cache->response + cache->response_size, server_data, data_size);
+    cache->response_size += data_size;
+    
+    full_size = cache_response_size(cache->response, cache->response_size);
+    
+    // let other handlers skip the wait for a response that can't be cached
+    if(full_size < 0) {
+        cache_pass(cache->request, cache->request_size);
+    }
+    
+    if(full_size < 0 || cache->response_size > full_size) {
+        end_cache_capture(cache, 0);
+    }
+    else if(full_size > 0 && cache->response_size == full_size) {
+        end_cache_capture(cache, 1);
+    }
+}
+
+static void end_cache_capture(
+    struct connection_cache *cache,
+    int store) {
+
+/*
+    Ends the capture of a response, storing it in the cache if store is set.
+    A capture that ends without a complete response leaves the response
+    boundaries on the connection unknown, so the cache isn't used again.
+*/
+    
+    if(cache->request == NULL) {
+        return;
+    }
+    
+    if(store) {
+        cache_store(
+            cache->request,
+            cache->request_size,
+            cache->response,
+            cache->response_size
+        );
+    }
+    else {
+        cache_abandon(cache->request, cache->request_size);
+        cache->usable = 0;
+    }
+    
+    free(cache->request);
+    free(cache->response);
+    memory_release(CACHE_OBJECT_MAX);
+    cache->request = NULL;
+    cache->response = NULL;
+}
+
+static void revalidate_cache_entry(
+    struct connection_cache *cache,
+    const char *request,
+    int request_size) {
+
+/*
+    Refreshes a stale cache entry that has just been served. The refresh is
+    done by a separate process over its own server connection, so that the
+    client doesn't wait for it.
+*/
+    
+    struct timeval timeout = {CACHE_FILL_WAIT_MS / 1000,
+        CACHE_FILL_WAIT_MS % 1000 * 1000};
+    char *response;
+    int response_size = 0;
+    int full_size = 0;
+    int bytes_read;
+    
+    int pid = fork();
+    if(pid != 0) {
+        if(pid < 0) {
+            cache_abandon(request, request_size);
+        }
+        return;
+    }
+    
+    // the connection handler's sockets must close when it closes them
+    close(cache->client_socket);
+    if(cache->server_socket >= 0) {
+        close(cache->server_socket);
+    }
+    
+    int server_socket = init_remote_server_socket();
+    setsockopt(
+        server_socket,
+        SOL_SOCKET,
+        SO_RCVTIMEO,
+        &timeout,
+        sizeof(timeout)
+    );
+    
+    response = malloc(CACHE_OBJECT_MAX);
+    
+    if(response != NULL
+        && send(server_socket, request, request_size, 0) == request_size) {
+        
+        while(response_size < CACHE_OBJECT_MAX) {
+            bytes_read = recv(
+                server_socket,
+                response + response_size,
+                CACHE_OBJECT_MAX - response_size,
+                0
+            );
+            
+            if(bytes_read <= 0) {
+                break;
+            }
+            
+            response_size += bytes_read;
+            full_size = cache_response_size(response, response_size);
+            
+            if(full_size < 0 || (full_size > 0 && response_size >= full_size)) {
+                break;
+            }
+        }
+    }
+    
+    if(full_size > 0 && response_size == full_size) {
+        cache_store(request, request_size, response, response_size);
+    }
+    else if(full_size < 0) {
+        cache_pass(request, request_size);
+    }
+    else {
+        cache_abandon(request, request_size);
+    }
+    
+    close(server_socket);
+    exit(0);
+}
+
+static void reset_socket(int socket) {
+
+    // makes the following close() send RST instead of FIN
+
+    struct linger linger;
+    linger.l_onoff = 1;
+    linger.l_linger = 0;
+    setsockopt(socket, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
 }
 
 static void die(char *error_message) {
@@ -313,6 +1326,367 @@ static void die(char *error_message) {
     exit(1);
 }
 
+static void request_stats(int signal_number) {
+    stats_requested = 1;
+}
+
+static void request_trace(int signal_number) {
+    trace_requested = 1;
+}
+
+static void child_exited(int signal_number) {
+    children_exited = 1;
+}
+
+static void handle_requests() {
+
+/*
+    Serves the requests made by signal to the accepting process.
+*/
+    
+    if(children_exited) {
+        children_exited = 0;
+        reap_children();
+    }
+    
+    if(stats_requested) {
+        stats_requested = 0;
+        proxy_stats_log();
+    }
+    
+    if(trace_requested) {
+        trace_requested = 0;
+        int events = trace_dump(TRACE_DUMP_PATH);
+        
+        if(events < 0) {
+            syslog(LOG_WARNING, "could not write %s\n", TRACE_DUMP_PATH);
+        }
+        else {
+            syslog(
+                LOG_INFO,
+                "wrote %d trace events to %s\n",
+                events,
+                TRACE_DUMP_PATH
+            );
+        }
+    }
+}
+
+static void reap_children() {
+
+/*
+    Collects the exit status of every child process that has exited and
+    reclaims the memory still charged to it.
+*/
+    
+    int pid;
+    
+    while((pid = waitpid(-1, NULL, WNOHANG)) > 0) {
+        memory_reclaim(pid);
+    }
+}
+
+static void init_connection_timeouts(
+    struct connection_timeouts *timeouts,
+    int client_socket) {
+
+/*
+    Arms the deadlines of a new connection. The header deadline runs from the
+    moment the connection is accepted, since the client is expected to start
+    with a request.
+*/
+    
+    uint64_t now = timer_now_ms();
+    
+    timeouts->buffering = 1;
+    timeouts->was_buffering = 0;
+    timeouts->rate_bytes = 0;
+    timeouts->reason = NULL;
+    timeouts->client_socket = client_socket;
+    timeouts->client_unsent = 0;
+    
+    timer_wheel_init(&timeouts->wheel, now);
+    
+    timer_init(&timeouts->header_timer, header_timeout, timeouts);
+    timer_init(&timeouts->rate_timer, rate_check, timeouts);
+    timer_init(&timeouts->idle_timer, idle_timeout, timeouts);
+    timer_init(&timeouts->lifetime_timer, lifetime_timeout, timeouts);
+    timer_init(&timeouts->drain_timer, drain_timeout, timeouts);
+    
+    timer_add(&timeouts->wheel, &timeouts->header_timer,
+        now + HEADER_TIMEOUT_MS);
+    timer_add(&timeouts->wheel, &timeouts->rate_timer,
+        now + RATE_CHECK_INTERVAL_MS);
+    timer_add(&timeouts->wheel, &timeouts->idle_timer,
+        now + IDLE_TIMEOUT_MS);
+    timer_add(&timeouts->wheel, &timeouts->lifetime_timer,
+        now + LIFETIME_TIMEOUT_MS);
+}
+
+static void update_client_timeouts(
+    struct connection_timeouts *timeouts,
+    int client_verdict) {
+
+/*
+    Called with each client_callback verdict. The header deadline starts when a
+    new request starts being buffered and is cancelled once a request has been
+    allowed through.
+*/
+    
+    timeouts->buffering = (client_verdict == PROXY_BUFFER);
+    
+    if(timeouts->buffering) {
+        if(!timer_pending(&timeouts->header_timer)) {
+            timer_add(
+                &timeouts->wheel,
+                &timeouts->header_timer,
+                timer_now_ms() + HEADER_TIMEOUT_MS
+            );
+        }
+    }
+    else {
+        timer_del(&timeouts->header_timer);
+    }
+}
+
+static void header_timeout(void *arg) {
+    struct connection_timeouts *timeouts = arg;
+    
+    if(timeouts->reason == NULL) {
+        timeouts->reason = "header";
+        PROXY_STATS_INC(timeouts_header);
+    }
+}
+
+static void rate_check(void *arg) {
+
+/*
+    Periodic check of the client transfer rate. Only windows during which the
+    client was buffering a request from start to end are judged, so idle
+    keep-alive connections are left to the idle deadline.
+*/
+    
+    struct connection_timeouts *timeouts = arg;
+    long min_bytes = (long) MIN_CLIENT_RATE * RATE_CHECK_INTERVAL_MS / 1000;
+    
+    if(timeouts->was_buffering && timeouts->buffering
+        && timeouts->rate_bytes < min_bytes) {
+        
+        if(timeouts->reason == NULL) {
+            timeouts->reason = "rate";
+            PROXY_STATS_INC(timeouts_rate);
+        }
+        return;
+    }
+    
+    timeouts->was_buffering = timeouts->buffering;
+    timeouts->rate_bytes = 0;
+    timer_add(
+        &timeouts->wheel,
+        &timeouts->rate_timer,
+        timer_now_ms() + RATE_CHECK_INTERVAL_MS
+    );
+}
+
+static void idle_timeout(void *arg) {
+
+/*
+    The idle deadline is pushed back whenever data is received or sent. Data
+    that has been sent may still sit in the kernel for long while a slow
+    client reads it, so the connection isn't idle either while that shrinks.
+*/
+    
+    struct connection_timeouts *timeouts = arg;
+    int unsent;
+    
+    if(ioctl(timeouts->client_socket, SIOCOUTQ, &unsent) == 0 && unsent > 0
+        && unsent != timeouts->client_unsent) {
+        
+        timeouts->client_unsent = unsent;
+        timer_add(
+            &timeouts->wheel,
+            &timeouts->idle_timer,
+            timer_now_ms() + IDLE_TIMEOUT_MS
+        );
+        return;
+    }
+    
+    if(timeouts->reason == NULL) {
+        timeouts->reason = "idle";
+        PROXY_STATS_INC(timeouts_idle);
+    }
+}
+
+static void lifetime_timeout(void *arg) {
+    struct connection_timeouts *timeouts = arg;
+    
+    if(timeouts->reason == NULL) {
+        timeouts->reason = "lifetime";
+        PROXY_STATS_INC(timeouts_lifetime);
+    }
+}
+
+static void start_drain_timeout(struct connection_timeouts *timeouts) {
+
+    // called when a side closes, the deadline runs from the first close
+    
+    if(!timer_pending(&timeouts->drain_timer)) {
+        timer_add(
+            &timeouts->wheel,
+            &timeouts->drain_timer,
+            timer_now_ms() + DRAIN_TIMEOUT_MS
+        );
+    }
+}
+
+static void drain_timeout(void *arg) {
+    struct connection_timeouts *timeouts = arg;
+    
+    if(timeouts->reason == NULL) {
+        timeouts->reason = "drain";
+        PROXY_STATS_INC(timeouts_drain);
+    }
+}
+
+static char *buffer_alloc(int *buffer_size) {
+
+/*
+    Allocates a minimum size connection buffer. The minimum buffers are always
+    granted, so the memory budget is only enforced when buffers grow.
+*/
+    
+    char *buffer;
+    
+    memory_reserve(BUFFER_MIN_SIZE, 1);
+    
+    buffer = malloc(BUFFER_MIN_SIZE);
+    if(buffer == NULL) {
+        die("malloc() failed");
+    }
+    
+    *buffer_size = BUFFER_MIN_SIZE;
+    return buffer;
+}
+
+static int buffer_grow(
+    char **buffer,
+    int *buffer_size,
+    int buffer_bytes) {
+
+/*
+    Doubles a full buffer, up to the per-connection cap and as far as the
+    memory budget allows. Returns 1 if the buffer has room for more data after
+    the call, 0 otherwise.
+*/
+    
+    int new_size;
+    char *new_buffer;
+    
+    if(buffer_bytes < *buffer_size) {
+        return 1;
+    }
+    
+    new_size = *buffer_size * 2;
+    if(new_size > (int) memory_buffer_cap()) {
+        new_size = memory_buffer_cap();
+    }
+    
+    if(new_size <= *buffer_size
+        || !memory_reserve(new_size - *buffer_size, 0)) {
+        
+        return 0;
+    }
+    
+    new_buffer = realloc(*buffer, new_size);
+    if(new_buffer == NULL) {
+        memory_release(new_size - *buffer_size);
+        return 0;
+    }
+    
+    *buffer = new_buffer;
+    *buffer_size = new_size;
+    return 1;
+}
+
+static void buffer_trim(
+    char **buffer,
+    int *buffer_size,
+    int buffer_bytes) {
+
+/*
+    Shrinks a buffer that is larger than the current per-connection cap, as
+    far as the data in it allows.
+*/
+    
+    int new_size = memory_buffer_cap();
+    char *new_buffer;
+    
+    if(new_size < buffer_bytes) {
+        new_size = buffer_bytes;
+    }
+    
+    if(new_size < BUFFER_MIN_SIZE) {
+        new_size = BUFFER_MIN_SIZE;
+    }
+    
+    if(new_size >= *buffer_size) {
+        return;
+    }
+    
+    new_buffer = realloc(*buffer, new_size);
+    if(new_buffer == NULL) {
+        return;
+    }
+    
+    memory_release(*buffer_size - new_size);
+    *buffer = new_buffer;
+    *buffer_size = new_size;
+}
+
+static void buffer_append(
+    char **buffer,
+    int *buffer_size,
+    int *buffer_bytes,
+    const char *data,
+    int data_size) {
+
+/*
+    Appends data to a buffer, growing it as needed. Only used for responses
+    from the cache, which are at most CACHE_OBJECT_MAX bytes, so the growth is
+    charged even if it exceeds the memory budget. buffer_trim() gives it back
+    once the data has been sent.
+*/
+    
+    int new_size = *buffer_size;
+    char *new_buffer;
+    
+    while(new_size - *buffer_bytes < data_size) {
+        new_size *= 2;
+    }
+    
+    if(new_size > *buffer_size) {
+        new_buffer = realloc(*buffer, new_size);
+        if(new_buffer == NULL) {
+            die("realloc() failed");
+        }
+        
+        memory_reserve(new_size - *buffer_size, 1);
+        *buffer = new_buffer;
+        *buffer_size = new_size;
+    }
+    
+    memcpy(*buffer + *buffer_bytes, data, data_size);
+    *buffer_bytes += data_size;
+}
+
+static void buffer_free(
+    char *buffer,
+    int buffer_size) {
+    
+    free(buffer);
+    memory_release(buffer_size);
+}
+
 static void construct_sockaddr_in(
     struct sockaddr_in *sock_addr,
     uint32_t ip_address,
@@ -336,6 +1710,12 @@ static int init_local_server_socket() {
         die("socket() failed");
     }
     
+    // allow binding while connections from a previous run are in TIME_WAIT
+    int reuse_addr = 1;
+    if (setsockopt(local_server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse_addr, sizeof(reuse_addr)) < 0) {
+        die("setsockopt() failed");
+    }
+    
     // Construct local address structure
     construct_sockaddr_in(
         &local_server_addr,
@@ -350,12 +1730,32 @@ static int init_local_server_socket() {
     // Mark the socket so it will listen for incoming connections
     if (listen(local_server_socket, MAXPENDING) < 0)
         die("listen() failed");
-        
-    //setsockopt reuse addr
     
     return local_server_socket;
 }
 
+static void drain_and_exit() {
+
+/*
+    Called by the accepting process after it has handed off its listening
+    socket. Waits for all connection handlers to finish, then exits.
+*/
+    
+    int pid;
+    
+    syslog(LOG_INFO, "draining in-flight connections\n");
+    
+    while((pid = wait(NULL)) >= 0 || errno == EINTR) {
+        if(pid > 0) {
+            memory_reclaim(pid);
+        }
+        handle_requests();
+    }
+    
+    syslog(LOG_INFO, "drained, exiting\n");
+    exit(0);
+}
+
 static int init_remote_server_socket() {
     int remote_server_socket;
     struct sockaddr_in remote_server_addr;
@@ -25,12 +25,21 @@
 #define PROXY_BUFFER    1
 #define PROXY_BLOCK     2
 
+#define PROXY_INSPECT_INLINE    0
+#define PROXY_INSPECT_ASYNC     1
+
 
 void reverse_proxy(
     int (*client_callback_arg)(const char *, int),
     int (*server_callback_arg)(const char *, int)
 );
 
+void reverse_proxy_async_inspection(
+    int (*route_callback_arg)(const char *, int)
+);
+
+void reverse_proxy_mark_startup();
+
 
 #endif // REVERSE_PROXY_H_
 